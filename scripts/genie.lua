@@ -47,7 +47,12 @@ solution "c8e"
 
     project "c8e"
         kind "ConsoleApp"
-        files {"../src/**"}
+        includedirs {"../src"}
+        files {
+            "../src/**",
+            "../.build/aot/**.cpp", -- Output of c8e-aot.
+        }
+        excludes {"../src/tools/**"}
         links {"sfml"}
 
         flags {
@@ -66,6 +71,7 @@ solution "c8e"
 
         configuration {"vs*"}
             buildoptions {
+                "/wd4127", -- warning C4127: conditional expression is constant
                 "/wd4201", -- warning C4201: nonstandard extension used: nameless struct/union
             }
 
@@ -81,9 +87,111 @@ solution "c8e"
                 "X11",
                 "Xrandr",
                 "pthread",
+                "rt",
                 "udev",
             }
 
+    project "c8e-aot"
+        kind "ConsoleApp"
+        files {
+            "../src/compat/**",
+            "../src/jit.*",
+            "../src/system.*",
+            "../src/tools/aot.cpp",
+        }
+
+        flags {
+            "ExtraWarnings",
+            "FatalWarnings",
+        }
+
+        configuration {"vs*"}
+            buildoptions {
+                "/wd4127", -- warning C4127: conditional expression is constant
+                "/wd4201", -- warning C4201: nonstandard extension used: nameless struct/union
+            }
+
+    project "c8e-headless"
+        kind "ConsoleApp"
+        includedirs {"../src"}
+        files {
+            "../src/compat/**",
+            "../src/jit.*",
+            "../src/parse.*",
+            "../src/ring.*",
+            "../src/runner.*",
+            "../src/system.*",
+            "../src/tools/headless.cpp",
+            "../.build/aot/**.cpp", -- Output of c8e-aot.
+        }
+
+        flags {
+            "ExtraWarnings",
+            "FatalWarnings",
+        }
+
+        configuration {"vs*"}
+            buildoptions {
+                "/wd4127", -- warning C4127: conditional expression is constant
+                "/wd4201", -- warning C4201: nonstandard extension used: nameless struct/union
+            }
+
+        configuration {"linux"}
+            links {"rt"}
+
+    project "c8e-batch"
+        kind "ConsoleApp"
+        includedirs {"../src"}
+        files {
+            "../src/compat/**",
+            "../src/jit.*",
+            "../src/parse.*",
+            "../src/ring.*",
+            "../src/runner.*",
+            "../src/system.*",
+            "../src/tools/batch.cpp",
+            "../.build/aot/**.cpp", -- Output of c8e-aot.
+        }
+
+        flags {
+            "ExtraWarnings",
+            "FatalWarnings",
+        }
+
+        configuration {"vs*"}
+            buildoptions {
+                "/wd4127", -- warning C4127: conditional expression is constant
+                "/wd4201", -- warning C4201: nonstandard extension used: nameless struct/union
+            }
+
+        configuration {"linux"}
+            links {"pthread", "rt"}
+
+    project "c8e-bench"
+        kind "ConsoleApp"
+        includedirs {"../src"}
+        files {
+            "../src/compat/**",
+            "../src/expand.*",
+            "../src/jit.*",
+            "../src/lockstep.*",
+            "../src/system.*",
+            "../src/vecenv.*",
+            "../src/tools/bench.cpp",
+            "../.build/aot/**.cpp", -- Output of c8e-aot.
+        }
+
+        flags {
+            "ExtraWarnings",
+            "FatalWarnings",
+        }
+
+        configuration {"vs*"}
+            buildoptions {
+                "/wd4127", -- warning C4127: conditional expression is constant
+                "/wd4201", -- warning C4201: nonstandard extension used: nameless struct/union
+            }
+
     project "sfml"
         kind "StaticLib"
         targetdir "../.build/lib"
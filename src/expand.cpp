@@ -0,0 +1,140 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include "expand.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#   define C8E_EXPAND_X64 1
+#   include <immintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define C8E_TARGET_AVX2
+#   else
+#       define C8E_TARGET_AVX2 __attribute__((target("avx2")))
+#   endif
+#endif
+
+namespace c8e
+{
+
+    static void expandScalar(const uint64_t* rows, uint32_t numRows, uint32_t fg, uint32_t bg, uint32_t* o_pixels)
+    {
+        const uint32_t diff = fg ^ bg;
+
+        for (uint32_t y = 0; y < numRows; ++y)
+        {
+            const uint64_t row = rows[y];
+
+            for (uint32_t x = 0; x < 64; ++x)
+            {
+                const uint32_t bit = uint32_t(row >> (63 - x)) & 1;
+                *(o_pixels++) = bg ^ (diff & (0 - bit));
+            }
+        }
+    }
+
+#if defined(C8E_EXPAND_X64)
+
+    // Eight pixels at a time come from one byte of the row, spread to every
+    // lane and tested against the bit for each lane's pixel, which gives a
+    // mask to pick the color with.
+
+    static void expandSse2(const uint64_t* rows, uint32_t numRows, uint32_t fg, uint32_t bg, uint32_t* o_pixels)
+    {
+        const __m128i bits0 = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+        const __m128i bits1 = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+        const __m128i bgs   = _mm_set1_epi32(int32_t(bg));
+        const __m128i diff  = _mm_set1_epi32(int32_t(fg ^ bg));
+
+        for (uint32_t y = 0; y < numRows; ++y)
+        {
+            const uint64_t row = rows[y];
+
+            for (int32_t shift = 56; shift >= 0; shift -= 8)
+            {
+                const __m128i byte = _mm_set1_epi32(int32_t((row >> shift) & 0xFF));
+                const __m128i set0 = _mm_cmpeq_epi32(_mm_and_si128(byte, bits0), bits0);
+                const __m128i set1 = _mm_cmpeq_epi32(_mm_and_si128(byte, bits1), bits1);
+
+                _mm_storeu_si128((__m128i*)o_pixels + 0, _mm_xor_si128(bgs, _mm_and_si128(set0, diff)));
+                _mm_storeu_si128((__m128i*)o_pixels + 1, _mm_xor_si128(bgs, _mm_and_si128(set1, diff)));
+                o_pixels += 8;
+            }
+        }
+    }
+
+    C8E_TARGET_AVX2 static void expandAvx2(const uint64_t* rows, uint32_t numRows, uint32_t fg, uint32_t bg, uint32_t* o_pixels)
+    {
+        const __m256i bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+        const __m256i bgs  = _mm256_set1_epi32(int32_t(bg));
+        const __m256i diff = _mm256_set1_epi32(int32_t(fg ^ bg));
+
+        for (uint32_t y = 0; y < numRows; ++y)
+        {
+            // The row's bytes in both halves, for the shuffles to pick from.
+            // The leftmost pixels are in the last byte.
+            const __m256i row = _mm256_set1_epi64x(int64_t(rows[y]));
+
+            for (int32_t n = 7; n >= 0; --n)
+            {
+                const __m256i byte = _mm256_shuffle_epi8(row, _mm256_set1_epi8(char(n)));
+                const __m256i set  = _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits);
+
+                _mm256_storeu_si256((__m256i*)o_pixels, _mm256_xor_si256(bgs, _mm256_and_si256(set, diff)));
+                o_pixels += 8;
+            }
+        }
+    }
+
+    static bool hasAvx2()
+    {
+#if defined(_MSC_VER)
+        // The OS has to save the upper halves of the registers, too.
+        int32_t info[4];
+        __cpuid(info, 1);
+        const bool osSaves = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+        __cpuidex(info, 7, 0);
+        return osSaves && (info[1] & (1 << 5));
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+
+#endif // defined(C8E_EXPAND_X64)
+
+    ExpandFn expandFn(ExpandKernel kernel)
+    {
+        switch (kernel)
+        {
+            case EXPAND_SCALAR:
+                return expandScalar;
+
+#if defined(C8E_EXPAND_X64)
+            case EXPAND_SSE2:
+                return expandSse2;
+
+            case EXPAND_AVX2:
+                return (hasAvx2() ? expandAvx2 : nullptr);
+#endif
+
+            default:
+                return nullptr;
+        }
+    }
+
+    static ExpandFn bestExpandFn()
+    {
+        ExpandFn fn = expandFn(EXPAND_AVX2);
+        fn = (fn ? fn : expandFn(EXPAND_SSE2));
+        return (fn ? fn : expandScalar);
+    }
+
+    void expandRows(const uint64_t* rows, uint32_t numRows, uint32_t fg, uint32_t bg, uint32_t* o_pixels)
+    {
+        static const ExpandFn s_best = bestExpandFn();
+        s_best(rows, numRows, fg, bg, o_pixels);
+    }
+
+} // namespace c8e
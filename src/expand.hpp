@@ -0,0 +1,31 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <cstdint>
+
+namespace c8e
+{
+
+    enum ExpandKernel : uint8_t
+    {
+        EXPAND_SCALAR,
+        EXPAND_SSE2,
+        EXPAND_AVX2,
+    };
+
+    // Expands `numRows` framebuffer rows, one bit per pixel with the most
+    // significant bit leftmost, to 64 pixels each of `fg` where set and `bg`
+    // where not.
+    using ExpandFn = void (*)(const uint64_t* rows, uint32_t numRows, uint32_t fg, uint32_t bg, uint32_t* o_pixels);
+
+    // Returns nullptr if the host doesn't support the kernel.
+    ExpandFn expandFn(ExpandKernel kernel);
+
+    // Expands with the fastest kernel the host supports.
+    void expandRows(const uint64_t* rows, uint32_t numRows, uint32_t fg, uint32_t bg, uint32_t* o_pixels);
+
+} // namespace c8e
@@ -0,0 +1,51 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include "input.hpp"
+
+namespace c8e
+{
+
+    void inputQueueInit(InputQueue* queue)
+    {
+        queue->head.store(0, std::memory_order_relaxed);
+        queue->tail.store(0, std::memory_order_relaxed);
+    }
+
+    bool inputQueuePush(InputQueue* queue, const InputEvent& event)
+    {
+        // The counters run freely, and wrap together.
+        const uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+
+        if (tail - queue->head.load(std::memory_order_acquire) == InputQueue::SIZE)
+        {
+            return false;
+        }
+
+        queue->events[tail % InputQueue::SIZE] = event;
+        queue->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool inputQueuePeek(InputQueue* queue, InputEvent* o_event)
+    {
+        const uint32_t head = queue->head.load(std::memory_order_relaxed);
+
+        if (head == queue->tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        *o_event = queue->events[head % InputQueue::SIZE];
+        return true;
+    }
+
+    void inputQueuePop(InputQueue* queue)
+    {
+        const uint32_t head = queue->head.load(std::memory_order_relaxed);
+        queue->head.store(head + 1, std::memory_order_release);
+    }
+
+} // namespace c8e
@@ -0,0 +1,40 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace c8e
+{
+
+    struct InputEvent
+    {
+        uint64_t time; // Host time the keys changed, from pacerNow().
+        uint16_t keys; // All keys held from then on, as System::Keys.
+    };
+
+    // Lock-free ring of input events, pushed by one thread and popped by
+    // another.
+    struct InputQueue
+    {
+        static constexpr uint32_t SIZE = 256;
+
+        InputEvent            events[SIZE];
+        std::atomic<uint32_t> head; // Next to pop, only written by the consumer.
+        std::atomic<uint32_t> tail; // Next to push, only written by the producer.
+    };
+
+    void inputQueueInit(InputQueue* queue);
+
+    // Returns false, dropping the event, if the queue is full.
+    bool inputQueuePush(InputQueue* queue, const InputEvent& event);
+
+    // Returns false if the queue is empty.
+    bool inputQueuePeek(InputQueue* queue, InputEvent* o_event);
+    void inputQueuePop(InputQueue* queue);
+
+} // namespace c8e
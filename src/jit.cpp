@@ -0,0 +1,497 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "compat/time.hpp"
+
+#include "jit.hpp"
+#include "system.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#if defined(_WIN32)
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <sys/mman.h>
+#endif
+
+namespace c8e
+{
+
+    static constexpr size_t   CODE_SIZE       = 256 * 1024;
+    static constexpr uint32_t MAX_BLOCKS      = 4096;
+    static constexpr uint32_t MAX_BLOCK_OPS   = 64;
+    static constexpr size_t   MAX_BLOCK_BYTES = MAX_BLOCK_OPS * 64;
+    static constexpr size_t   MEM_SIZE        = sizeof(System::mem);
+
+    // Generated code only touches these, and r8 for the instructions left
+    // in the budget, which are caller-saved in both the System V and the
+    // Windows x64 calling conventions.
+    static constexpr uint8_t REG_EAX = 0;
+    static constexpr uint8_t REG_EDX = 2;
+
+#if defined(_WIN32)
+    static constexpr uint8_t REG_SYS    = 1; // rcx
+    static constexpr uint8_t REG_MAXOPS = 2; // edx
+#else
+    static constexpr uint8_t REG_SYS    = 7; // rdi
+    static constexpr uint8_t REG_MAXOPS = 6; // esi
+#endif
+
+    static const JitBlock s_interpret{nullptr, 0, 0};
+
+    struct Jit
+    {
+        uint8_t*        code;
+        size_t          codeUsed;
+        JitBlock        blocks[MAX_BLOCKS];
+        uint32_t        numBlocks;
+        const JitBlock* lookup[MEM_SIZE];
+        uint8_t         covered[MEM_SIZE];
+    };
+
+    struct Emitter
+    {
+        uint8_t* cur;
+    };
+
+    static void emit8(Emitter* e, uint8_t val)
+    {
+        *(e->cur++) = val;
+    }
+
+    static void emit16(Emitter* e, uint16_t val)
+    {
+        emit8(e, uint8_t(val));
+        emit8(e, uint8_t(val >> 8));
+    }
+
+    static void emit32(Emitter* e, uint32_t val)
+    {
+        emit16(e, uint16_t(val));
+        emit16(e, uint16_t(val >> 16));
+    }
+
+    // ModRM for `[sys + disp32]`, with `reg` in the reg field.
+    static void emitMem(Emitter* e, uint8_t reg, size_t disp)
+    {
+        emit8(e, 0x80 | (reg << 3) | REG_SYS);
+        emit32(e, uint32_t(disp));
+    }
+
+    static size_t offsetV(uint8_t reg)
+    {
+        return offsetof(System, V) + reg;
+    }
+
+    // movzx reg32, byte [V + x]
+    static void emitLoadV(Emitter* e, uint8_t reg, uint8_t x)
+    {
+        emit8(e, 0x0F);
+        emit8(e, 0xB6);
+        emitMem(e, reg, offsetV(x));
+    }
+
+    // mov byte [V + x], reg8
+    static void emitStoreV(Emitter* e, uint8_t reg, uint8_t x)
+    {
+        emit8(e, 0x88);
+        emitMem(e, reg, offsetV(x));
+    }
+
+    // mov word [pc], addr
+    static void emitSetPc(Emitter* e, uint16_t addr)
+    {
+        emit8(e, 0x66);
+        emit8(e, 0xC7);
+        emitMem(e, 0, offsetof(System, pc));
+        emit16(e, addr);
+    }
+
+    // mov eax, val ; ret
+    static void emitReturn(Emitter* e, uint32_t val)
+    {
+        emit8(e, 0xB8);
+        emit32(e, val);
+        emit8(e, 0xC3);
+    }
+
+    // pc = (ZF == zfSkips) ? next + 2 : next
+    static void emitSkip(Emitter* e, uint16_t next, bool zfSkips)
+    {
+        emit8(e, 0xB8);                     // mov eax, next
+        emit32(e, next);
+        emit8(e, 0xBA);                     // mov edx, next + 2
+        emit32(e, next + 2);
+        emit8(e, 0x0F);                     // cmove/cmovne eax, edx
+        emit8(e, zfSkips ? 0x44 : 0x45);
+        emit8(e, 0xC2);
+        emit8(e, 0x66);                     // mov word [pc], ax
+        emit8(e, 0x89);
+        emitMem(e, REG_EAX, offsetof(System, pc));
+    }
+
+    // Emits code for the instruction. Returns false if the instruction has to
+    // be interpreted, in which case nothing was emitted. Sets `o_ends` if the
+    // instruction ends the block, in which case it has also set the pc.
+    static bool emitOp(Emitter* e, uint16_t op, uint16_t next, bool* o_ends)
+    {
+        const uint8_t  x   = (op & 0x0F00) >> 8;
+        const uint8_t  y   = (op & 0x00F0) >> 4;
+        const uint8_t  nn  = (op & 0x00FF);
+        const uint16_t nnn = (op & 0x0FFF);
+
+        *o_ends = false;
+
+        switch (op & 0xF000)
+        {
+            case 0x0000:
+                // 0x0NNN is ignored, the rest are left to the interpreter.
+                return (op != 0x00E0 && op != 0x00EE);
+
+            case 0x1000: // 0x1NNN : Jumps to address NNN.
+                emitSetPc(e, nnn);
+                *o_ends = true;
+                return true;
+
+            case 0x3000: // 0x3XNN : Skips the next instruction if VX equals NN.
+            case 0x4000: // 0x4XNN : Skips the next instruction if VX doesn't equal NN.
+                emit8(e, 0x80);                 // cmp byte [VX], nn
+                emitMem(e, 7, offsetV(x));
+                emit8(e, nn);
+                emitSkip(e, next, (op & 0xF000) == 0x3000);
+                *o_ends = true;
+                return true;
+
+            case 0x5000: // 0x5XY0 : Skips the next instruction if VX equals VY.
+                emitLoadV(e, REG_EAX, x);
+                emit8(e, 0x3A);                 // cmp al, byte [VY]
+                emitMem(e, REG_EAX, offsetV(y));
+                emitSkip(e, next, true);
+                *o_ends = true;
+                return true;
+
+            case 0x6000: // 0x6XNN : Sets VX to NN.
+                emit8(e, 0xC6);                 // mov byte [VX], nn
+                emitMem(e, 0, offsetV(x));
+                emit8(e, nn);
+                return true;
+
+            case 0x7000: // 0x7XNN : Adds NN to VX.
+                emit8(e, 0x80);                 // add byte [VX], nn
+                emitMem(e, 0, offsetV(x));
+                emit8(e, nn);
+                return true;
+
+            case 0x8000:
+                switch (op & 0x000F)
+                {
+                    case 0x0000: // 0x8XY0 : Sets VX to the value of VY.
+                        emitLoadV(e, REG_EAX, y);
+                        emitStoreV(e, REG_EAX, x);
+                        return true;
+
+                    case 0x0001: // 0x8XY1 : Sets VX to VX or VY.
+                    case 0x0002: // 0x8XY2 : Sets VX to VX and VY.
+                    case 0x0003: // 0x8XY3 : Sets VX to VX xor VY.
+                    {
+                        static const uint8_t s_opcodes[] = {0x08, 0x20, 0x30};
+                        emitLoadV(e, REG_EAX, y);
+                        emit8(e, s_opcodes[(op & 0x000F) - 1]); // or/and/xor byte [VX], al
+                        emitMem(e, REG_EAX, offsetV(x));
+                        return true;
+                    }
+
+                    case 0x0004: // 0x8XY4 : Adds VY to VX. VF is set to 1 when there's a carry.
+                        emitLoadV(e, REG_EAX, x);
+                        emitLoadV(e, REG_EDX, y);
+                        emit8(e, 0x01);                 // add eax, edx
+                        emit8(e, 0xD0);
+                        emitStoreV(e, REG_EAX, x);
+                        emit8(e, 0xC1);                 // shr eax, 8
+                        emit8(e, 0xE8);
+                        emit8(e, 0x08);
+                        emitStoreV(e, REG_EAX, 0xF);
+                        return true;
+
+                    case 0x0005: // 0x8XY5 : VY is subtracted from VX. VF is set to 0 when there's a borrow.
+                    case 0x0007: // 0x8XY7 : Sets VX to VY minus VX. VF is set to 0 when there's a borrow.
+                    {
+                        const bool rev = (op & 0x000F) == 0x0007;
+                        emitLoadV(e, REG_EAX, rev ? y : x);
+                        emitLoadV(e, REG_EDX, rev ? x : y);
+                        emit8(e, 0x29);                 // sub eax, edx
+                        emit8(e, 0xD0);
+                        emit8(e, 0x0F);                 // setae dl
+                        emit8(e, 0x93);
+                        emit8(e, 0xC2);
+                        emitStoreV(e, REG_EAX, x);
+                        emitStoreV(e, REG_EDX, 0xF);
+                        return true;
+                    }
+
+                    case 0x0006: // 0x8XY6 : Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
+                        emitLoadV(e, REG_EAX, x);
+                        emit8(e, 0x83);                 // and eax, 1
+                        emit8(e, 0xE0);
+                        emit8(e, 0x01);
+                        emitStoreV(e, REG_EAX, 0xF);
+                        emitLoadV(e, REG_EAX, x);
+                        emit8(e, 0xD1);                 // shr eax, 1
+                        emit8(e, 0xE8);
+                        emitStoreV(e, REG_EAX, x);
+                        return true;
+
+                    case 0x000E: // 0x8XYE : Stores the most significant bit of VX in VF and then shifts VX to the left by 1.
+                        emitLoadV(e, REG_EAX, x);
+                        emit8(e, 0xC1);                 // shr eax, 7
+                        emit8(e, 0xE8);
+                        emit8(e, 0x07);
+                        emitStoreV(e, REG_EAX, 0xF);
+                        emitLoadV(e, REG_EAX, x);
+                        emit8(e, 0x01);                 // add eax, eax
+                        emit8(e, 0xC0);
+                        emitStoreV(e, REG_EAX, x);
+                        return true;
+
+                    default:
+                        return false;
+                }
+
+            case 0xA000: // 0xANNN : Sets I to the address NNN.
+                emit8(e, 0x66);                         // mov word [I], nnn
+                emit8(e, 0xC7);
+                emitMem(e, 0, offsetof(System, I));
+                emit16(e, nnn);
+                return true;
+
+            case 0xF000:
+                switch (op & 0x00FF)
+                {
+                    case 0x001E: // 0xFX1E : Adds VX to I.
+                        emitLoadV(e, REG_EAX, x);
+                        emit8(e, 0x66);                 // add word [I], ax
+                        emit8(e, 0x01);
+                        emitMem(e, REG_EAX, offsetof(System, I));
+                        return true;
+
+                    case 0x0029: // 0xFX29 : Sets I to the location of the sprite for the character in VX.
+                        emitLoadV(e, REG_EAX, x);
+                        emit8(e, 0x8D);                 // lea eax, [rax + rax * 4]
+                        emit8(e, 0x04);
+                        emit8(e, 0x80);
+                        emit8(e, 0x66);                 // mov word [I], ax
+                        emit8(e, 0x89);
+                        emitMem(e, REG_EAX, offsetof(System, I));
+                        return true;
+
+                    default:
+                        return false;
+                }
+
+            default:
+                return false;
+        }
+    }
+
+    static void flush(Jit* jit)
+    {
+        jit->codeUsed  = 0;
+        jit->numBlocks = 0;
+        memset(jit->lookup, 0, sizeof(jit->lookup));
+        memset(jit->covered, 0, sizeof(jit->covered));
+    }
+
+    static const JitBlock* translate(Jit* jit, const System* sys, uint16_t pc)
+    {
+        if (jit->numBlocks == MAX_BLOCKS || jit->codeUsed + MAX_BLOCK_BYTES > CODE_SIZE)
+        {
+            flush(jit);
+        }
+
+        uint8_t* start = jit->code + jit->codeUsed;
+        Emitter  e{start};
+        uint8_t* exits[MAX_BLOCK_OPS]; // Where each instruction's jump to its early exit stores the offset.
+        uint32_t numOps = 0;
+        uint16_t lastOp = 0;
+        uint16_t addr   = pc;
+        bool     ends   = false;
+
+        emit8(&e, 0x41);                        // mov r8d, maxOps
+        emit8(&e, 0x89);
+        emit8(&e, 0xC0 | (REG_MAXOPS << 3));
+
+        while (!ends && numOps < MAX_BLOCK_OPS && addr + 1u < MEM_SIZE)
+        {
+            const uint16_t op    = (sys->mem[addr] << 8) | sys->mem[addr + 1];
+            uint8_t*       begin = e.cur;
+
+            if (numOps)
+            {
+                // Leave early once the budget runs out, so that blocks are
+                // never too long to enter.
+                emit8(&e, 0x41);                // dec r8d
+                emit8(&e, 0xFF);
+                emit8(&e, 0xC8);
+                emit8(&e, 0x0F);                // jz exit
+                emit8(&e, 0x84);
+                exits[numOps] = e.cur;
+                emit32(&e, 0);
+            }
+
+            if (!emitOp(&e, op, addr + 2, &ends))
+            {
+                e.cur = begin;
+                break;
+            }
+
+            lastOp = op;
+            addr  += 2;
+            ++numOps;
+        }
+
+        if (!numOps)
+        {
+            return &s_interpret;
+        }
+
+        if (!ends)
+        {
+            emitSetPc(&e, addr);
+        }
+
+        emitReturn(&e, numOps);
+
+        for (uint32_t i = 1; i < numOps; ++i)
+        {
+            const uint32_t rel = uint32_t(e.cur - (exits[i] + 4));
+            memcpy(exits[i], &rel, sizeof(rel));
+
+            emitSetPc(&e, uint16_t(pc + i * 2));
+            emitReturn(&e, i);
+        }
+
+        memset(jit->covered + pc, 1, addr - pc);
+        jit->codeUsed += size_t(e.cur - start);
+
+        JitBlock* block = &jit->blocks[jit->numBlocks++];
+        block->fn     = reinterpret_cast<uint32_t (*)(System*, uint32_t)>(start);
+        block->numOps = numOps;
+        block->lastOp = lastOp;
+
+        return block;
+    }
+
+    Jit* jitCreate()
+    {
+        Jit* jit = static_cast<Jit*>(calloc(1, sizeof(Jit)));
+
+        if (!jit)
+        {
+            return nullptr;
+        }
+
+#if defined(_WIN32)
+        void* code = VirtualAlloc(nullptr, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+        void* code = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        code = (code == MAP_FAILED ? nullptr : code);
+#endif
+
+        if (!code)
+        {
+            free(jit);
+            return nullptr;
+        }
+
+        jit->code = static_cast<uint8_t*>(code);
+        return jit;
+    }
+
+    void jitDestroy(Jit* jit)
+    {
+        if (jit)
+        {
+#if defined(_WIN32)
+            VirtualFree(jit->code, 0, MEM_RELEASE);
+#else
+            munmap(jit->code, CODE_SIZE);
+#endif
+            free(jit);
+        }
+    }
+
+    const JitBlock* jitLookup(Jit* jit, const System* sys, uint16_t pc)
+    {
+        if (pc >= MEM_SIZE)
+        {
+            return nullptr;
+        }
+
+        const JitBlock* block = jit->lookup[pc];
+
+        if (!block)
+        {
+            block = translate(jit, sys, pc);
+            jit->lookup[pc] = block;
+        }
+
+        return (block == &s_interpret ? nullptr : block);
+    }
+
+    void jitInvalidate(Jit* jit, uint16_t addr, uint16_t size)
+    {
+        // An instruction starting on the byte before `addr` overlaps it too.
+        const size_t first = (addr ? addr - 1 : 0);
+        const size_t end   = (size_t(addr) + size < MEM_SIZE ? size_t(addr) + size : MEM_SIZE);
+
+        for (size_t i = first; i < end; ++i)
+        {
+            if (jit->covered[i])
+            {
+                // Blocks don't know which other blocks overlap them, so just
+                // start over. Self-modifying code is rare enough for this not
+                // to matter.
+                flush(jit);
+                return;
+            }
+
+            jit->lookup[i] = nullptr;
+        }
+    }
+
+} // namespace c8e
+
+#else // defined(__x86_64__) || defined(_M_X64)
+
+namespace c8e
+{
+
+    Jit* jitCreate()
+    {
+        return nullptr;
+    }
+
+    void jitDestroy(Jit*)
+    {
+    }
+
+    const JitBlock* jitLookup(Jit*, const System*, uint16_t)
+    {
+        return nullptr;
+    }
+
+    void jitInvalidate(Jit*, uint16_t, uint16_t)
+    {
+    }
+
+} // namespace c8e
+
+#endif // defined(__x86_64__) || defined(_M_X64)
@@ -0,0 +1,35 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <cstdint>
+
+namespace c8e
+{
+
+    struct System;
+
+    struct Jit;
+
+    struct JitBlock
+    {
+        uint32_t (*fn)(System* sys, uint32_t maxOps); // Runs at most `maxOps` instructions, and returns how many it ran.
+        uint32_t numOps;
+        uint16_t lastOp;
+    };
+
+    // Returns nullptr if the host is not supported.
+    Jit* jitCreate();
+    void jitDestroy(Jit* jit);
+
+    // Returns the block starting at `pc`, translating it on first use.
+    // Returns nullptr if the instruction at `pc` has to be interpreted.
+    const JitBlock* jitLookup(Jit* jit, const System* sys, uint16_t pc);
+
+    // Drops all translations that overlap the given memory range.
+    void jitInvalidate(Jit* jit, uint16_t addr, uint16_t size);
+
+} // namespace c8e
@@ -0,0 +1,994 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <cstdint>
+#include <cstring>
+
+#include "lockstep.hpp"
+#include "system.hpp"
+
+namespace c8e
+{
+
+    static constexpr uint32_t TIMER_HZ = 60;
+
+    // Lanes per distinct pc, on average, from which running them in groups
+    // pays for forming the groups. Below it, lanes run one at a time.
+    static constexpr uint32_t MIN_LANES_PER_PC = 8;
+
+    // Which lanes run the current instruction, as a bit each, and as a byte
+    // each to mask with in loops over the lanes from the first to the last
+    // in the group. Those loops are written without branches on the lane, so
+    // that they compile to vector code.
+    struct Group
+    {
+        uint32_t lanes;
+        uint8_t  on[LOCKSTEP_LANES]; // One if in the group, zero if not.
+        uint32_t from;  // First lane in the group.
+        uint32_t to;    // One past the last lane in the group.
+        uint64_t steps; // Instructions until a lane in the group is out of cycles.
+        bool     split; // Whether the lanes may no longer be at the same pc.
+        bool     wrote; // Whether lanes wrote to memory, so may no longer agree on code.
+
+        uint64_t end[LOCKSTEP_LANES]; // Cycle at which each lane's run ends, or ended for waiting or faulting.
+    };
+
+    template<class T>
+    static T select(uint8_t on, T value, T cur)
+    {
+        const T mask = T(T(0) - T(on));
+        return T((value & mask) | (cur & T(~mask)));
+    }
+
+    static void setGroup(Group* group, uint32_t lanes)
+    {
+        group->lanes = lanes;
+        group->from  = LOCKSTEP_LANES;
+        group->to    = 0;
+
+        for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+        {
+            group->on[l] = uint8_t((lanes >> l) & 1);
+
+            if (group->on[l])
+            {
+                group->from = (l < group->from ? l : group->from);
+                group->to   = l + 1;
+            }
+        }
+    }
+
+    // As setGroup, for a group of only lane `l`. Leaves the rest of `on` as
+    // it was, since single lane groups only look at their own entry.
+    static void setSingle(Group* group, uint32_t l)
+    {
+        group->lanes = (1u << l);
+        group->on[l] = 1;
+        group->from  = l;
+        group->to    = l + 1;
+    }
+
+    // Takes the lane out of the group, and out of the rest of the run.
+    static void stopLane(Lockstep* ls, Group* group, uint32_t l, RunExit exit)
+    {
+        group->end[l] = ls->cycles[l];
+        group->lanes &= ~(1u << l);
+        group->on[l]  = 0;
+        group->split  = true;
+        ls->exit[l]   = exit;
+    }
+
+    // As System's, memory accessed through I wraps around at the end, so
+    // that no lane reaches into another's.
+    static uint16_t wrapAddr(uint32_t addr)
+    {
+        return uint16_t(addr % sizeof(Lockstep::image));
+    }
+
+    // Reads the instruction at `addr`. Past the end of memory it's one that
+    // doesn't exist, so that lanes fault there as System does.
+    static uint16_t readOp(const Lockstep* ls, uint32_t l, uint16_t addr)
+    {
+        if (addr > sizeof(ls->image) - 2)
+        {
+            return 0xFFFF;
+        }
+
+        return uint16_t((ls->mem[l][addr] << 8) | ls->mem[l][addr + 1]);
+    }
+
+    static void markWritten(Lockstep* ls, uint32_t addr, uint32_t size)
+    {
+        if (addr + size > sizeof(ls->image))
+        {
+            // Wrapped around, so may have written anywhere.
+            addr = 0;
+            size = sizeof(ls->image);
+        }
+
+        ls->writtenFrom = (addr < ls->writtenFrom ? addr : ls->writtenFrom);
+        ls->writtenTo   = (addr + size > ls->writtenTo ? addr + size : ls->writtenTo);
+    }
+
+    // Whether lanes may have different instructions at `pc`.
+    static bool mayDiffer(const Lockstep* ls, uint16_t pc)
+    {
+        return uint32_t(pc) + 2 > ls->writtenFrom && pc < ls->writtenTo;
+    }
+
+    static uint64_t currentTick(const Lockstep* ls, uint32_t l)
+    {
+        return ls->cycles[l] * TIMER_HZ / ls->cycleHz;
+    }
+
+    static void drawHorizLine(Lockstep* ls, uint32_t l, uint8_t x, uint8_t y, uint8_t w, uint8_t px)
+    {
+        const uint64_t mask = (uint64_t(px) << (64 - w)) >> x;
+        const uint64_t cur  = ls->fb[l][y];
+
+        if (cur & mask)
+        {
+            ls->V[0xF][l] = 1;
+        }
+
+        ls->fb[l][y]     = cur ^ mask;
+        ls->fbDirty[l] |= uint32_t(mask != 0) << y;
+    }
+
+    // As System's DXYN, for one lane.
+    static void drawSprite(Lockstep* ls, uint32_t l, uint8_t regX, uint8_t regY, uint8_t h)
+    {
+        static constexpr uint8_t NUM_ROWS = sizeof(System::Fb) / sizeof(uint64_t);
+
+        if (ls->quirks & QUIRK_DISPLAY_WAIT)
+        {
+            const uint64_t tick = currentTick(ls, l);
+
+            if (tick < ls->drawTick[l])
+            {
+                ls->pc[l] -= 2;
+                return;
+            }
+
+            ls->drawTick[l] = tick + 1;
+        }
+
+        const uint8_t  x = ls->V[regX][l] % 64;
+        const uint8_t  y = ls->V[regY][l] % NUM_ROWS;
+        const uint8_t* mem = ls->mem[l];
+        const uint16_t I   = ls->I[l];
+
+        ls->V[0xF][l] = 0;
+
+        if (ls->quirks & QUIRK_CLIP_SPRITES)
+        {
+            const uint8_t w = (x <= 56 ? 8 : 64 - x);
+
+            for (uint8_t n = 0; n < h && y + n < NUM_ROWS; ++n)
+            {
+                drawHorizLine(ls, l, x, y + n, w, mem[wrapAddr(I + n)] >> (8 - w));
+            }
+        }
+        else if (x <= 56)
+        {
+            for (uint8_t n = 0; n < h; ++n)
+            {
+                drawHorizLine(ls, l, x, (y + n) % NUM_ROWS, 8, mem[wrapAddr(I + n)]);
+            }
+        }
+        else
+        {
+            const uint8_t w1 = 64 - x;
+            const uint8_t w2 = 8 - w1;
+
+            for (uint8_t n = 0; n < h; ++n)
+            {
+                const uint8_t row = (y + n) % NUM_ROWS;
+                const uint8_t px  = mem[wrapAddr(I + n)];
+
+                drawHorizLine(ls, l, x, row, w1, px >> w2);
+                drawHorizLine(ls, l, 0, row, w2, px & ((1 << w2) - 1));
+            }
+        }
+    }
+
+    // Runs `op` for the lanes in the group, whose pc are all past it.
+    // With `SINGLE` for groups of one lane, which runs the loops over lanes
+    // once, rather than setting up to vectorize them.
+    template<bool SINGLE>
+    static void execOp(Lockstep* ls, Group* group, uint16_t op)
+    {
+        const uint8_t* on   = group->on;
+        const uint32_t from = group->from;
+        const uint32_t to   = (SINGLE ? from + 1 : group->to);
+        const uint16_t nnn = (op & 0x0FFF);
+        const uint8_t  nn  = (op & 0x00FF);
+        const uint8_t  x   = (op & 0x0F00) >> 8;
+        const uint8_t  y   = (op & 0x00F0) >> 4;
+        uint8_t*       VX  = ls->V[x];
+        uint8_t*       VY  = ls->V[y];
+        uint8_t*       VF  = ls->V[0xF];
+
+        switch (op & 0xF000)
+        {
+            case 0x0000:
+            {
+                if (op == 0x00E0)
+                {
+                    for (uint32_t l = from; l < to; ++l)
+                    {
+                        if (!on[l])
+                        {
+                            continue;
+                        }
+
+                        for (uint32_t row = 0; row < sizeof(System::Fb) / sizeof(uint64_t); ++row)
+                        {
+                            ls->fbDirty[l] |= uint32_t(ls->fb[l][row] != 0) << row;
+                            ls->fb[l][row]  = 0;
+                        }
+                    }
+                }
+                else if (op == 0x00EE)
+                {
+                    for (uint32_t l = from; l < to; ++l)
+                    {
+                        if (!on[l])
+                        {
+                            continue;
+                        }
+
+                        if (ls->sp[l] <= 0)
+                        {
+                            ls->pc[l] -= 2;
+                            stopLane(ls, group, l, RUN_STACK_FAULT);
+                            continue;
+                        }
+
+                        ls->pc[l] = ls->stack[--(ls->sp[l])][l];
+                    }
+                }
+
+                break;
+            }
+
+            case 0x1000: // 0x1NNN : Jumps to address NNN.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    ls->pc[l] = select(on[l], nnn, ls->pc[l]);
+                }
+
+                break;
+            }
+
+            case 0x2000: // 0x2NNN : Calls subroutine at NNN.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    if (!on[l])
+                    {
+                        continue;
+                    }
+
+                    if (ls->sp[l] >= 16)
+                    {
+                        ls->pc[l] -= 2;
+                        stopLane(ls, group, l, RUN_STACK_FAULT);
+                        continue;
+                    }
+
+                    ls->stack[(ls->sp[l])++][l] = ls->pc[l];
+                    ls->pc[l] = nnn;
+                }
+
+                break;
+            }
+
+            case 0x3000: // 0x3XNN : Skips the next instruction if VX equals NN.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    ls->pc[l] += uint16_t((VX[l] == nn) & on[l]) << 1;
+                }
+
+                break;
+            }
+
+            case 0x4000: // 0x4XNN : Skips the next instruction if VX doesn't equal NN.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    ls->pc[l] += uint16_t((VX[l] != nn) & on[l]) << 1;
+                }
+
+                break;
+            }
+
+            case 0x5000: // 0x5XY0 : Skips the next instruction if VX equals VY.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    ls->pc[l] += uint16_t((VX[l] == VY[l]) & on[l]) << 1;
+                }
+
+                break;
+            }
+
+            case 0x6000: // 0x6XNN : Sets VX to NN.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    VX[l] = select(on[l], nn, VX[l]);
+                }
+
+                break;
+            }
+
+            case 0x7000: // 0x7XNN : Adds NN to VX. (Carry flag is not changed)
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    VX[l] = uint8_t(VX[l] + (nn & uint8_t(0 - on[l])));
+                }
+
+                break;
+            }
+
+            case 0x8000:
+            {
+                // Where X is F, which of VX and VF is written last matters,
+                // so each is written in the same order as System does.
+                switch (op & 0x000F)
+                {
+                    case 0x0: // 0x8XY0 : Sets VX to the value of VY.
+                        for (uint32_t l = from; l < to; ++l)
+                        {
+                            VX[l] = select(on[l], VY[l], VX[l]);
+                        }
+
+                        break;
+
+                    case 0x1: // 0x8XY1 : Sets VX to VX or VY. (Bitwise OR operation)
+                    case 0x2: // 0x8XY2 : Sets VX to VX and VY. (Bitwise AND operation)
+                    case 0x3: // 0x8XY3 : Sets VX to VX xor VY.
+                    {
+                        const uint8_t n = (op & 0x000F);
+
+                        for (uint32_t l = from; l < to; ++l)
+                        {
+                            const uint8_t res = (n == 1 ? VX[l] | VY[l] : n == 2 ? VX[l] & VY[l] : VX[l] ^ VY[l]);
+                            VX[l] = select(on[l], res, VX[l]);
+                        }
+
+                        if (ls->quirks & QUIRK_VF_RESET)
+                        {
+                            for (uint32_t l = from; l < to; ++l)
+                            {
+                                VF[l] = select(on[l], uint8_t(0), VF[l]);
+                            }
+                        }
+
+                        break;
+                    }
+
+                    case 0x4: // 0x8XY4 : Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+                        for (uint32_t l = from; l < to; ++l)
+                        {
+                            const uint16_t res = VX[l] + VY[l];
+                            VX[l] = select(on[l], uint8_t(res), VX[l]);
+                            VF[l] = select(on[l], uint8_t(res >> 8), VF[l]);
+                        }
+
+                        break;
+
+                    case 0x5: // 0x8XY5 : VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+                        for (uint32_t l = from; l < to; ++l)
+                        {
+                            const uint8_t vf = (VX[l] >= VY[l]);
+                            VX[l] = select(on[l], uint8_t(VX[l] - VY[l]), VX[l]);
+                            VF[l] = select(on[l], vf, VF[l]);
+                        }
+
+                        break;
+
+                    case 0x7: // 0x8XY7 : Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+                        for (uint32_t l = from; l < to; ++l)
+                        {
+                            const uint8_t vf = (VY[l] >= VX[l]);
+                            VX[l] = select(on[l], uint8_t(VY[l] - VX[l]), VX[l]);
+                            VF[l] = select(on[l], vf, VF[l]);
+                        }
+
+                        break;
+
+                    case 0x6: // 0x8XY6 : Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
+                    case 0xE: // 0x8XYE : Stores the most significant bit of VX in VF and then shifts VX to the left by 1.
+                    {
+                        const bool right = ((op & 0x000F) == 0x6);
+
+                        for (uint32_t l = from; l < to; ++l)
+                        {
+                            if (ls->quirks & QUIRK_SHIFT_VY)
+                            {
+                                const uint8_t vy = VY[l];
+                                VX[l] = select(on[l], uint8_t(right ? vy >> 1 : vy << 1), VX[l]);
+                                VF[l] = select(on[l], uint8_t(right ? vy & 1 : vy >> 7), VF[l]);
+                            }
+                            else
+                            {
+                                VF[l] = select(on[l], uint8_t(right ? VX[l] & 1 : VX[l] >> 7), VF[l]);
+                                VX[l] = select(on[l], uint8_t(right ? VX[l] >> 1 : VX[l] << 1), VX[l]);
+                            }
+                        }
+
+                        break;
+                    }
+
+                    default:
+                        for (uint32_t l = from; l < to; ++l)
+                        {
+                            if (on[l])
+                            {
+                                ls->pc[l] -= 2;
+                                stopLane(ls, group, l, RUN_UNKNOWN_OP);
+                            }
+                        }
+
+                        break;
+                }
+
+                break;
+            }
+
+            case 0x9000: // 0x9XY0 : Skips the next instruction if VX doesn't equal VY.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    ls->pc[l] += uint16_t((x != y) & on[l]) << 1;
+                }
+
+                break;
+            }
+
+            case 0xA000: // 0xANNN : Sets I to the address NNN.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    ls->I[l] = select(on[l], nnn, ls->I[l]);
+                }
+
+                break;
+            }
+
+            case 0xB000: // 0xBNNN : Jumps to the address NNN plus V0.
+            {
+                const uint8_t* V = (ls->quirks & QUIRK_JUMP_VX ? VX : ls->V[0]);
+
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    ls->pc[l] = select(on[l], uint16_t(nnn + V[l]), ls->pc[l]);
+                }
+
+                break;
+            }
+
+            case 0xC000: // 0xCXNN : Sets VX to the result of a bitwise and operation on a random number (Typically: 0 to 255) and NN.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    uint32_t r = ls->rng[l];
+                    r ^= r << 13;
+                    r ^= r >> 17;
+                    r ^= r << 5;
+
+                    ls->rng[l] = select(on[l], r, ls->rng[l]);
+                    VX[l]      = select(on[l], uint8_t((r >> 24) & nn), VX[l]);
+                }
+
+                break;
+            }
+
+            case 0xD000: // 0xDXYN: Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels.
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    if (on[l])
+                    {
+                        drawSprite(ls, l, x, y, op & 0x000F);
+                    }
+                }
+
+                break;
+            }
+
+            case 0xE000:
+            {
+                if (nn != 0x9E && nn != 0xA1)
+                {
+                    for (uint32_t l = from; l < to; ++l)
+                    {
+                        if (on[l])
+                        {
+                            ls->pc[l] -= 2;
+                            stopLane(ls, group, l, RUN_UNKNOWN_OP);
+                        }
+                    }
+
+                    break;
+                }
+
+                // 0xEX9E : Skips the next instruction if the key stored in VX is pressed.
+                // 0xEXA1 : Skips the next instruction if the key stored in VX isn't pressed.
+                const uint8_t skipIf = (nn == 0x9E ? 1 : 0);
+
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    const uint8_t pressed = uint8_t(VX[l] < 16 && (ls->keys[l] >> VX[l]) & 1);
+                    ls->pc[l] += uint16_t((pressed == skipIf) & on[l]) << 1;
+                }
+
+                break;
+            }
+
+            case 0xF000:
+            {
+                for (uint32_t l = from; l < to; ++l)
+                {
+                    if (!on[l])
+                    {
+                        continue;
+                    }
+
+                    uint8_t* mem = ls->mem[l];
+
+                    switch (nn)
+                    {
+                        case 0x07: // 0xFX07 : Sets VX to the value of the delay timer.
+                        {
+                            const uint64_t tick = currentTick(ls, l);
+                            VX[l] = uint8_t(ls->delayEnd[l] > tick ? ls->delayEnd[l] - tick : 0);
+                            break;
+                        }
+
+                        case 0x0A: // 0xFX0A : A key press is awaited, and then stored in VX. (Blocking Operation.)
+                        {
+                            if (!ls->keys[l])
+                            {
+                                // As systemRun, spend the rest of the run
+                                // waiting.
+                                ls->pc[l]    -= 2;
+                                ls->cycles[l] = group->end[l];
+                                stopLane(ls, group, l, RUN_WAIT_KEY);
+                                break;
+                            }
+
+                            uint8_t key = 0;
+
+                            while (!(ls->keys[l] & (1 << key)))
+                            {
+                                ++key;
+                            }
+
+                            VX[l] = key;
+                            break;
+                        }
+
+                        case 0x15: // 0xFX15 : Sets the delay timer to VX.
+                            ls->delayEnd[l] = currentTick(ls, l) + VX[l];
+                            break;
+
+                        case 0x18: // 0xFX18 : Sets the sound timer to VX.
+                            ls->soundEnd[l] = (VX[l] ? currentTick(ls, l) + VX[l] : 0);
+                            break;
+
+                        case 0x1E: // 0xFX1E : Adds VX to I.
+                            ls->I[l] += VX[l];
+                            break;
+
+                        case 0x29: // 0xFX29 : Sets I to the location of the sprite for the character in VX.
+                            ls->I[l] = VX[l] * 5;
+                            break;
+
+                        case 0x33: // 0xFX33 : Stores the binary-coded decimal representation of VX at I, I plus 1 and I plus 2.
+                            mem[wrapAddr(ls->I[l] + 0)] = VX[l] / 100;
+                            mem[wrapAddr(ls->I[l] + 1)] = (VX[l] / 10) % 10;
+                            mem[wrapAddr(ls->I[l] + 2)] = VX[l] % 10;
+                            markWritten(ls, wrapAddr(ls->I[l]), 3);
+                            group->wrote = true;
+                            break;
+
+                        case 0x55: // 0xFX55 : Stores V0 to VX (including VX) in memory starting at address I.
+                            for (uint8_t i = 0; i <= x; ++i)
+                            {
+                                mem[wrapAddr(ls->I[l] + i)] = ls->V[i][l];
+                            }
+
+                            markWritten(ls, wrapAddr(ls->I[l]), x + 1);
+                            ls->I[l]     = uint16_t(ls->I[l] + (ls->quirks & QUIRK_INC_I ? x + 1 : 0));
+                            group->wrote = true;
+                            break;
+
+                        case 0x65: // 0xFX65 : Fills V0 to VX (including VX) with values from memory starting at address I.
+                            for (uint8_t i = 0; i <= x; ++i)
+                            {
+                                ls->V[i][l] = mem[wrapAddr(ls->I[l] + i)];
+                            }
+
+                            ls->I[l] = uint16_t(ls->I[l] + (ls->quirks & QUIRK_INC_I ? x + 1 : 0));
+                            break;
+
+                        default:
+                            ls->pc[l] -= 2;
+                            stopLane(ls, group, l, RUN_UNKNOWN_OP);
+                            break;
+                    }
+                }
+
+                break;
+            }
+        }
+    }
+
+    // Whether `op` may take the lanes in a group to different instructions.
+    static bool mayBranch(uint16_t op, uint8_t quirks)
+    {
+        switch (op & 0xF000)
+        {
+            case 0x0000: return (op == 0x00EE);
+            case 0x3000: return true;
+            case 0x4000: return true;
+            case 0x5000: return true;
+            case 0xB000: return true;
+            case 0xD000: return (quirks & QUIRK_DISPLAY_WAIT) != 0;
+            case 0xE000: return true;
+            default:     return false;
+        }
+    }
+
+    // Picks the lane furthest behind, and the lanes at the same instruction
+    // as it. Returns false when no lane has cycles left to run.
+    static bool formGroup(const Lockstep* ls, Group* group, uint16_t* o_op)
+    {
+        uint32_t lead  = LOCKSTEP_LANES;
+        uint64_t least = UINT64_MAX;
+
+        for (uint32_t l = 0; l < ls->numLanes; ++l)
+        {
+            if (ls->cycles[l] < group->end[l] && ls->cycles[l] < least)
+            {
+                lead  = l;
+                least = ls->cycles[l];
+            }
+        }
+
+        if (lead == LOCKSTEP_LANES)
+        {
+            return false;
+        }
+
+        const uint16_t pc     = ls->pc[lead];
+        const uint16_t op     = readOp(ls, lead, pc);
+        const bool     differ = mayDiffer(ls, pc);
+        uint32_t       lanes  = 0;
+        uint64_t       steps  = UINT64_MAX;
+
+        for (uint32_t l = 0; l < ls->numLanes; ++l)
+        {
+            if (ls->cycles[l] < group->end[l] && ls->pc[l] == pc && (!differ || readOp(ls, l, pc) == op))
+            {
+                const uint64_t left = group->end[l] - ls->cycles[l];
+                lanes |= (1u << l);
+                steps  = (left < steps ? left : steps);
+            }
+        }
+
+        if (lanes == (1u << lead))
+        {
+            setSingle(group, lead);
+        }
+        else
+        {
+            setGroup(group, lanes);
+        }
+
+        group->steps = steps;
+        group->split = false;
+        group->wrote = false;
+        *o_op = op;
+        return true;
+    }
+
+    // Returns the next instruction of the group, if all its lanes still
+    // agree on it and have cycles left. The group is formed anew otherwise,
+    // rather than carrying on with some of it, to give lanes left behind the
+    // chance to catch up and join in again.
+    static bool keepGroup(const Lockstep* ls, Group* group, uint16_t* o_op)
+    {
+        if (!group->steps || !group->lanes)
+        {
+            return false;
+        }
+
+        const uint32_t lead = group->from;
+        const uint16_t pc   = ls->pc[lead];
+        const uint16_t op   = readOp(ls, lead, pc);
+
+        uint32_t differ = 0;
+
+        if (group->split)
+        {
+            for (uint32_t l = group->from; l < group->to; ++l)
+            {
+                differ |= group->on[l] & (ls->pc[l] != pc);
+            }
+
+            group->split = false;
+        }
+
+        if (group->wrote && mayDiffer(ls, pc))
+        {
+            for (uint32_t l = group->from; l < group->to && !differ; ++l)
+            {
+                differ |= group->on[l] & (readOp(ls, l, pc) != op);
+            }
+        }
+
+        group->wrote = false;
+
+        if (differ)
+        {
+            return false;
+        }
+
+        *o_op = op;
+        return true;
+    }
+
+    // Runs the group for as long as it holds together, which is for good
+    // when all lanes agree. A single lane can't disagree with itself, so
+    // runs until it's out of cycles, or stops.
+    template<bool SINGLE>
+    static void runGroup(Lockstep* ls, Group* group, uint16_t op)
+    {
+        const uint32_t from = group->from;
+        const uint32_t to   = (SINGLE ? from + 1 : group->to);
+
+        do
+        {
+            for (uint32_t l = from; l < to; ++l)
+            {
+                ls->pc[l]     += uint16_t(group->on[l]) << 1;
+                ls->cycles[l] += group->on[l];
+            }
+
+            execOp<SINGLE>(ls, group, op);
+            --group->steps;
+            ++ls->numGroups;
+
+            if (SINGLE)
+            {
+                if (!group->steps || !group->lanes)
+                {
+                    return;
+                }
+
+                op = readOp(ls, from, ls->pc[from]);
+            }
+            else
+            {
+                group->split |= mayBranch(op, ls->quirks);
+
+                if (!keepGroup(ls, group, &op))
+                {
+                    return;
+                }
+            }
+        }
+        while (true);
+    }
+
+    // Whether enough of the lanes with cycles left are at the same
+    // instructions for grouping them to pay off, going by roughly how many
+    // different pcs they're at.
+    static bool worthGrouping(const Lockstep* ls, const Group* group)
+    {
+        uint64_t seen     = 0;
+        uint32_t numLanes = 0;
+
+        for (uint32_t l = 0; l < ls->numLanes; ++l)
+        {
+            if (ls->cycles[l] < group->end[l])
+            {
+                seen |= uint64_t(1) << ((ls->pc[l] >> 1) & 63);
+                ++numLanes;
+            }
+        }
+
+        uint32_t numPcs = 0;
+
+        for (; seen; seen &= seen - 1)
+        {
+            ++numPcs;
+        }
+
+        return numPcs * MIN_LANES_PER_PC <= numLanes;
+    }
+
+    // Runs every lane with cycles left on its own, to the end of the run.
+    static void runEachLane(Lockstep* ls, Group* group)
+    {
+        for (uint32_t l = 0; l < ls->numLanes; ++l)
+        {
+            if (ls->cycles[l] < group->end[l])
+            {
+                setSingle(group, l);
+                group->steps = group->end[l] - ls->cycles[l];
+                runGroup<true>(ls, group, readOp(ls, l, ls->pc[l]));
+            }
+        }
+    }
+
+    void lockstepInit(Lockstep* ls, uint32_t numLanes)
+    {
+        memset(ls, 0, sizeof(*ls));
+        ls->numLanes = (numLanes < LOCKSTEP_LANES ? numLanes : LOCKSTEP_LANES);
+        ls->cycleHz  = DEFAULT_CYCLE_HZ;
+
+        // Start every lane as a freshly initialized system.
+        System      sys;
+        SystemState state;
+        systemInit(&sys);
+        systemSave(&sys, &state);
+        systemShutdown(&sys);
+
+        memcpy(ls->image, state.mem, sizeof(ls->image));
+        ls->writtenFrom = sizeof(ls->image);
+        ls->writtenTo   = 0;
+
+        for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+        {
+            lockstepRestore(ls, l, &state);
+        }
+    }
+
+    bool lockstepLoad(Lockstep* ls, const void* rom, uint16_t size)
+    {
+        if (size > sizeof(ls->mem[0]) - 0x200)
+        {
+            return false;
+        }
+
+        memcpy(ls->image + 0x200, rom, size);
+
+        for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+        {
+            memcpy(ls->mem[l] + 0x200, rom, size);
+        }
+
+        return true;
+    }
+
+    void lockstepSeed(Lockstep* ls, uint32_t lane, uint32_t seed)
+    {
+        // As systemSeed.
+        ls->rng[lane] = (seed ? seed : 0x2545F491);
+    }
+
+    void lockstepRun(Lockstep* ls, uint64_t maxCycles)
+    {
+        uint64_t ends[LOCKSTEP_LANES];
+
+        for (uint32_t l = 0; l < ls->numLanes; ++l)
+        {
+            ends[l] = ls->cycles[l] + maxCycles;
+        }
+
+        lockstepRunUntil(ls, ends);
+    }
+
+    void lockstepRunUntil(Lockstep* ls, const uint64_t* ends)
+    {
+        Group group{};
+
+        for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+        {
+            group.end[l] = (l < ls->numLanes && ends[l] > ls->cycles[l] ? ends[l] : ls->cycles[l]);
+            ls->exit[l]  = RUN_BUDGET;
+        }
+
+        if (!worthGrouping(ls, &group))
+        {
+            runEachLane(ls, &group);
+        }
+
+        uint16_t op;
+
+        while (formGroup(ls, &group, &op))
+        {
+            if (group.from + 1 == group.to)
+            {
+                // Lanes left on their own are a sign they've parted ways
+                // since the run started. Once too many have, forming groups
+                // costs more than it saves for the rest of the run.
+                if (!worthGrouping(ls, &group))
+                {
+                    runEachLane(ls, &group);
+                    break;
+                }
+
+                runGroup<true>(ls, &group, op);
+            }
+            else
+            {
+                runGroup<false>(ls, &group, op);
+            }
+        }
+
+        for (uint32_t l = 0; l < ls->numLanes; ++l)
+        {
+            // As updateSound, but silent.
+            if (ls->soundEnd[l] && currentTick(ls, l) >= ls->soundEnd[l])
+            {
+                ls->soundEnd[l] = 0;
+            }
+        }
+    }
+
+    void lockstepSave(const Lockstep* ls, uint32_t lane, SystemState* o_state)
+    {
+        memcpy(o_state->mem, ls->mem[lane], sizeof(o_state->mem));
+        memcpy(o_state->fb, ls->fb[lane], sizeof(o_state->fb));
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            o_state->stack[i] = ls->stack[i][lane];
+            o_state->V[i]     = ls->V[i][lane];
+        }
+
+        o_state->cycles   = ls->cycles[lane];
+        o_state->delayEnd = ls->delayEnd[lane];
+        o_state->soundEnd = ls->soundEnd[lane];
+        o_state->drawTick = ls->drawTick[lane];
+        o_state->op       = 0;
+        o_state->keys     = ls->keys[lane];
+        o_state->I        = ls->I[lane];
+        o_state->pc       = ls->pc[lane];
+        o_state->rng      = ls->rng[lane];
+        o_state->sp       = ls->sp[lane];
+    }
+
+    void lockstepRestore(Lockstep* ls, uint32_t lane, const SystemState* state)
+    {
+        for (uint32_t addr = 0; addr < sizeof(state->mem); ++addr)
+        {
+            if (state->mem[addr] != ls->image[addr])
+            {
+                markWritten(ls, addr, 1);
+            }
+        }
+
+        memcpy(ls->mem[lane], state->mem, sizeof(state->mem));
+        memcpy(ls->fb[lane], state->fb, sizeof(state->fb));
+
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            ls->stack[i][lane] = state->stack[i];
+            ls->V[i][lane]     = state->V[i];
+        }
+
+        ls->cycles[lane]   = state->cycles;
+        ls->delayEnd[lane] = state->delayEnd;
+        ls->soundEnd[lane] = state->soundEnd;
+        ls->drawTick[lane] = state->drawTick;
+        ls->keys[lane]     = state->keys;
+        ls->I[lane]        = state->I;
+        ls->pc[lane]       = state->pc;
+        ls->rng[lane]      = state->rng;
+        ls->sp[lane]       = state->sp;
+        ls->fbDirty[lane]  = 0;
+    }
+
+} // namespace c8e
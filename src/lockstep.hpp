@@ -0,0 +1,64 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include "system.hpp"
+
+namespace c8e
+{
+
+    constexpr uint32_t LOCKSTEP_LANES = 32;
+
+    // Up to LOCKSTEP_LANES instances of the same ROM, that may differ in
+    // their keys and seeds, run in lockstep. The state is kept as arrays with
+    // an entry per lane, so that an instruction runs for every lane that is
+    // at it in one go, over all lanes at once where it can. Lanes whose pc
+    // differ run in groups, the ones furthest behind first, which brings them
+    // back together when their paths meet again.
+    //
+    // Each lane behaves as a System run with systemRun would, with no sound.
+    struct Lockstep
+    {
+        uint8_t    V[16][LOCKSTEP_LANES];
+        uint16_t   I[LOCKSTEP_LANES];
+        uint16_t   pc[LOCKSTEP_LANES];
+        uint16_t   keys[LOCKSTEP_LANES];
+        uint16_t   stack[16][LOCKSTEP_LANES];
+        int8_t     sp[LOCKSTEP_LANES];
+        uint32_t   rng[LOCKSTEP_LANES];
+        uint32_t   fbDirty[LOCKSTEP_LANES]; // As System::fbDirty.
+        uint64_t   cycles[LOCKSTEP_LANES];
+        uint64_t   delayEnd[LOCKSTEP_LANES];
+        uint64_t   soundEnd[LOCKSTEP_LANES];
+        uint64_t   drawTick[LOCKSTEP_LANES];
+        RunExit    exit[LOCKSTEP_LANES]; // Out: Why each lane's last run ended; never RUN_FB_UPDATED, lanes draw without stopping.
+        System::Fb fb[LOCKSTEP_LANES];
+        uint8_t    mem[LOCKSTEP_LANES][4096];
+
+        // Memory as loaded into every lane. The lanes' memory only differs
+        // from it, and so from each other's, from `writtenFrom` up to
+        // `writtenTo`, where there's no telling if they run the same code.
+        uint8_t  image[4096];
+        uint32_t writtenFrom;
+        uint32_t writtenTo;
+
+        uint32_t numLanes;
+        uint32_t cycleHz; // As System::cycleHz, for all lanes.
+        uint8_t  quirks;  // Combination of Quirk flags, for all lanes.
+        uint64_t numGroups; // Groups of lanes run, one per instruction when all lanes agree.
+    };
+
+    void lockstepInit(Lockstep* ls, uint32_t numLanes);
+    bool lockstepLoad(Lockstep* ls, const void* rom, uint16_t size); // Into every lane.
+    void lockstepSeed(Lockstep* ls, uint32_t lane, uint32_t seed);
+    void lockstepRun(Lockstep* ls, uint64_t maxCycles); // Runs every lane for `maxCycles`, or until it faults.
+    void lockstepRunUntil(Lockstep* ls, const uint64_t* ends); // Runs each lane until its cycle in `ends`, or until it faults.
+    void lockstepSave(const Lockstep* ls, uint32_t lane, SystemState* o_state); // Leaves `op` zero; lanes don't keep it.
+    void lockstepRestore(Lockstep* ls, uint32_t lane, const SystemState* state);
+
+} // namespace c8e
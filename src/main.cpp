@@ -3,16 +3,23 @@
 // License: https://opensource.org/licenses/ISC
 //
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <thread>
 
 #include "compat/time.hpp"
 
 #include <SFML/Graphics.hpp>
 
+#include "expand.hpp"
+#include "input.hpp"
+#include "pacer.hpp"
+#include "parse.hpp"
 #include "system.hpp"
+#include "triplebuf.hpp"
 
 
 namespace c8e
@@ -23,6 +30,8 @@ namespace c8e
         sf::RenderWindow window;
         sf::Texture      texture;
         sf::Sprite       sprite;
+        uint32_t         fg; // RGBA, in memory order.
+        uint32_t         bg;
     };
 
 
@@ -31,6 +40,16 @@ namespace c8e
         bool        step{false};
         bool        help{false};
         bool        log{false};
+        uint32_t    hz{DEFAULT_CYCLE_HZ};
+        uint32_t    speed{1};
+        bool        unthrottled{false};
+        bool        stats{false};
+        const char* record{nullptr};
+        uint32_t    runAhead{0};
+        uint32_t    fg{0xFFFFFF};
+        uint32_t    bg{0x000000};
+        Engine      engine{ENGINE_SWITCH};
+        uint8_t     quirks{0};
         const char* path{nullptr};
     };
 
@@ -38,20 +57,87 @@ namespace c8e
     struct EventOpts
     {
         bool     step{false};
+        bool     fastForward{false}; // Held down to run unthrottled.
         uint16_t keys{0};
+        uint32_t speed{1};           // Multiplier on the instructions run per frame.
     };
 
 
-    static void renderCtxInit(RenderCtx* ctx)
+    struct FrameOut
+    {
+        bool    waiting{false};    // Waiting for a key when the frame ended.
+        RunExit fault{RUN_BUDGET}; // What stopped the frame short, if anything did.
+    };
+
+
+    // State shared between the render thread, which owns the window and
+    // takes input, and the emulation thread, which owns the system.
+    struct EmuCtx
+    {
+        System*               sys;
+        const Args*           args;
+        Pacer                 pacer;
+        TripleBuffer          fb;
+        SystemState           snapshot;   // To roll back to after running ahead.
+        uint32_t              aheadRows;  // Rows the last run ahead changed, shown but since rolled back.
+        uint64_t              runAheadNs; // Host time spent running ahead, in total.
+        uint64_t              runAheadMaxNs;
+        InputQueue            input;
+        FILE*                 record;     // Input applied, if recording.
+        uint64_t              inputStart; // Host time input has been applied up to.
+        std::atomic<uint32_t> steps;      // Step presses not yet run.
+        std::atomic<uint32_t> speed;
+        std::atomic<bool>     fastForward;
+        std::atomic<bool>     quit;       // Set by the render thread.
+        std::atomic<bool>     halted;     // Set by the emulation thread, on a fault.
+        std::atomic<int64_t>  waitHead;   // Input consumed while waiting for a key, or -1.
+        int32_t               result;
+    };
+
+
+    constexpr uint64_t NS_PER_SEC    = 1000000000;
+    constexpr uint64_t FRAME_HZ      = 60;
+    constexpr uint64_t FRAME_NS      = NS_PER_SEC / FRAME_HZ;
+    constexpr uint32_t MAX_SPEED     = 64;
+    constexpr uint32_t MAX_CATCH_UP  = 4;
+    constexpr uint32_t MAX_RUN_AHEAD = 8;
+    constexpr uint32_t INPUT_POLLS   = 4; // Per frame, which sets how precisely input is timed.
+
+    // Cycles run between checks of the clock when unthrottled.
+    constexpr uint64_t UNTHROTTLED_CYCLES = 4096;
+
+
+    // Converts 0xRRGGBB to an opaque RGBA pixel, as laid out in memory.
+    static uint32_t rgbaPixel(uint32_t rgb)
+    {
+        const uint8_t rgba[4] = {uint8_t(rgb >> 16), uint8_t(rgb >> 8), uint8_t(rgb), 0xFF};
+        uint32_t      pixel;
+        memcpy(&pixel, rgba, sizeof(pixel));
+        return pixel;
+    }
+
+    static void renderCtxInit(RenderCtx* ctx, uint32_t fg, uint32_t bg)
     {
         ctx->window.create(sf::VideoMode{640, 320}, "c8e", sf::Style::Titlebar | sf::Style::Close);
         ctx->texture.create(64, 32);
         ctx->sprite.setScale(10.0f, 10.0f);
+        ctx->fg = rgbaPixel(fg);
+        ctx->bg = rgbaPixel(bg);
+
+        // Start out blank, like the framebuffer, so only changes to it need
+        // uploading from here on.
+        const System::Fb blank = {};
+        uint32_t         pixels[64 * 32];
+        expandRows(blank, 32, ctx->fg, ctx->bg, pixels);
+        ctx->texture.update((const sf::Uint8*)pixels);
+
         ctx->sprite.setTexture(ctx->texture);
     }
 
 
-    static bool processEvents(sf::Window* window, EventOpts* opts)
+    // Key changes are queued with the time they were seen, for the emulation
+    // thread to apply at the matching cycle.
+    static bool processEvents(sf::Window* window, InputQueue* input, EventOpts* opts, bool block)
     {
         bool run = window->isOpen();
 
@@ -60,9 +146,12 @@ namespace c8e
         if (run)
         {
             sf::Event event;
+            bool      pending = (block ? window->waitEvent(event) : window->pollEvent(event));
 
-            while (window->pollEvent(event))
+            while (pending)
             {
+                const uint16_t keys = opts->keys;
+
                 switch (event.type)
                 {
                     case sf::Event::Closed:
@@ -74,6 +163,17 @@ namespace c8e
                         switch (event.key.code)
                         {
                             case sf::Keyboard::Key::Space: opts->step = true; break;
+                            case sf::Keyboard::Key::Tab:   opts->fastForward = true; break;
+
+                            case sf::Keyboard::Key::Equal:
+                                opts->speed = (opts->speed < MAX_SPEED ? opts->speed * 2 : MAX_SPEED);
+                                printf("Speed: %ux\n", unsigned(opts->speed));
+                                break;
+
+                            case sf::Keyboard::Key::Hyphen:
+                                opts->speed = (opts->speed > 1 ? opts->speed / 2 : 1);
+                                printf("Speed: %ux\n", unsigned(opts->speed));
+                                break;
 
                             case sf::Keyboard::Key::Num1:  opts->keys |= System::KEY_1; break;
                             case sf::Keyboard::Key::Num2:  opts->keys |= System::KEY_2; break;
@@ -100,6 +200,8 @@ namespace c8e
                     case sf::Event::KeyReleased:
                         switch (event.key.code)
                         {
+                            case sf::Keyboard::Key::Tab:   opts->fastForward = false; break;
+
                             case sf::Keyboard::Key::Num1:  opts->keys &= ~System::KEY_1; break;
                             case sf::Keyboard::Key::Num2:  opts->keys &= ~System::KEY_2; break;
                             case sf::Keyboard::Key::Num3:  opts->keys &= ~System::KEY_3; break;
@@ -125,6 +227,13 @@ namespace c8e
                     default:
                         break;
                 }
+
+                if (opts->keys != keys)
+                {
+                    inputQueuePush(input, InputEvent{pacerNow(), opts->keys});
+                }
+
+                pending = window->pollEvent(event);
             }
         }
 
@@ -132,32 +241,246 @@ namespace c8e
     }
 
 
-    static void drawFb(RenderCtx* ctx, const System::Fb& fb)
+    static void drawFb(RenderCtx* ctx, const System::Fb& fb, uint32_t dirty)
     {
-        // Convert from bit-array to RGBA.
+        // Convert from bit-array to RGBA, and upload, only the rows that
+        // changed. Adjacent ones are uploaded together.
         uint32_t pixels[64 * 32];
-        uint32_t* px = pixels;
 
-        for (int32_t y = 0; y < 32; ++y)
+        for (int32_t y = 0; y < 32;)
         {
-            const uint64_t row = fb[y];
+            if (!(dirty & (uint32_t(1) << y)))
+            {
+                ++y;
+                continue;
+            }
 
-            for (int64_t x = 0; x < 64; ++x)
+            const int32_t first = y;
+
+            while (y < 32 && (dirty & (uint32_t(1) << y)))
             {
-                const uint64_t mask  = uint64_t(1) << (63 - x);
-                const uint64_t bit   = row & mask;
-                const uint32_t color = bit ? UINT32_MAX : 0;
-                *(px++) = color;
+                ++y;
             }
-        }
 
-        ctx->texture.update((const sf::Uint8*)pixels);
+            expandRows(fb + first, uint32_t(y - first), ctx->fg, ctx->bg, pixels + first * 64);
+            ctx->texture.update((const sf::Uint8*)(pixels + first * 64), 64, unsigned(y - first), 0, unsigned(first));
+        }
 
         ctx->window.clear(sf::Color::Black);
         ctx->window.draw(ctx->sprite);
         ctx->window.display();
     }
 
+    // Runs the CPU until cycle `end`, one instruction at a time if they are to
+    // be logged, and in one burst otherwise. Returns false on a fault, which
+    // is left in `o_frame`.
+    static bool runUntil(System* sys, uint64_t end, bool log, FrameOut* o_frame)
+    {
+        while (sys->cycles < end)
+        {
+            RunExit exit;
+
+            if (log)
+            {
+                CycleOpts cycle;
+                systemCycle(sys, &cycle);
+                exit = cycle.exit;
+
+                char dasm[16];
+                systemDisasm(sys->op, dasm);
+                printf("%s\n", dasm);
+            }
+            else
+            {
+                RunResult result;
+                systemRun(sys, end - sys->cycles, &result);
+                exit = result.exit;
+            }
+
+            o_frame->waiting = (exit == RUN_WAIT_KEY);
+
+            switch (exit)
+            {
+                case RUN_UNKNOWN_OP:
+                case RUN_STACK_FAULT:
+                    o_frame->fault = exit;
+                    return false;
+
+                default:
+                    break;
+            }
+        }
+
+        return true;
+    }
+
+    static void reportFault(const System* sys, RunExit fault)
+    {
+        if (fault == RUN_UNKNOWN_OP)
+        {
+            fprintf(stderr, "ERROR: Unknown op code 0x%04X at 0x%03X.\n", sys->op, sys->pc);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Stack %s at 0x%03X.\n", sys->sp ? "overflow" : "underflow", sys->pc);
+        }
+    }
+
+    static void applyInput(EmuCtx* ctx, const InputEvent& event)
+    {
+        if (ctx->record && ctx->sys->keys != event.keys)
+        {
+            fprintf(ctx->record, "%llu %04X\n", (unsigned long long)ctx->sys->cycles, event.keys);
+        }
+
+        ctx->sys->keys = event.keys;
+    }
+
+    // Runs `maxCycles` as the host time since the last frame, applying the
+    // input queued over that time at the cycle it maps to. So input is one
+    // frame late, but keeps its timing within the frame however the frames
+    // are run. Input queued from before the last frame is applied up front.
+    static bool runFrame(EmuCtx* ctx, uint64_t maxCycles, FrameOut* o_frame)
+    {
+        System*        sys   = ctx->sys;
+        const bool     log   = ctx->args->log;
+        const uint64_t start = sys->cycles;
+        const uint64_t now   = pacerNow();
+        const uint64_t span  = (now > ctx->inputStart ? now - ctx->inputStart : 1);
+
+        InputEvent event;
+
+        while (inputQueuePeek(&ctx->input, &event) && event.time < now)
+        {
+            const uint64_t offset = (event.time > ctx->inputStart ? event.time - ctx->inputStart : 0);
+            const uint64_t at     = start + offset * maxCycles / span;
+
+            if (!runUntil(sys, at, log, o_frame))
+            {
+                return false;
+            }
+
+            applyInput(ctx, event);
+            inputQueuePop(&ctx->input);
+        }
+
+        ctx->inputStart = now;
+        return runUntil(sys, start + maxCycles, log, o_frame);
+    }
+
+    // Runs `maxCycles` ahead with the keys held now, publishes the framebuffer
+    // that leads to, and rolls back. Showing the future hides as much of the
+    // delay with which ROMs react to input, as long as the input doesn't
+    // change in the meantime. A fault is left for the real run to report.
+    static void runAhead(EmuCtx* ctx, uint64_t maxCycles)
+    {
+        System*        sys   = ctx->sys;
+        const uint64_t start = pacerNow();
+        const uint32_t rows  = sys->fbDirty;
+
+        FrameOut ahead;
+        systemSave(sys, &ctx->snapshot);
+        sys->muted   = true;
+        sys->fbDirty = 0;
+        runUntil(sys, sys->cycles + maxCycles, false, &ahead);
+
+        // What's on screen differs from this where the frame just run changed
+        // it, and where either run ahead did.
+        const uint32_t aheadRows = sys->fbDirty;
+
+        if (const uint32_t dirty = rows | aheadRows | ctx->aheadRows)
+        {
+            tripleBufferPublish(&ctx->fb, sys->fb, dirty);
+        }
+
+        ctx->aheadRows = aheadRows;
+        sys->muted     = false;
+        sys->fbDirty   = 0;
+        systemRestore(sys, &ctx->snapshot);
+
+        const uint64_t ns = pacerNow() - start;
+        ctx->runAheadNs   += ns;
+        ctx->runAheadMaxNs = (ns > ctx->runAheadMaxNs ? ns : ctx->runAheadMaxNs);
+    }
+
+    // Runs a frame at a time: takes input once, runs the frame's worth of
+    // cycles in one burst, publishes the framebuffer if it changed, and waits
+    // until the next frame is due. When behind, a few frames' worth are run
+    // before publishing to catch up.
+    static void emulate(EmuCtx* ctx)
+    {
+        System*     sys    = ctx->sys;
+        const Args* args   = ctx->args;
+        uint64_t    carry  = 0;
+        uint32_t    frames = 1;
+
+        pacerInit(&ctx->pacer, FRAME_NS, MAX_CATCH_UP);
+        ctx->inputStart = pacerNow();
+
+        while (!ctx->quit.load(std::memory_order_relaxed))
+        {
+            FrameOut frame;
+            bool     ok = true;
+
+            // Only step the CPU if manual stepping is turned off, or if the
+            // step button was pressed.
+            if (args->step)
+            {
+                const uint32_t steps = ctx->steps.exchange(0, std::memory_order_relaxed);
+                ok = runFrame(ctx, steps, &frame);
+            }
+            else if (args->unthrottled || ctx->fastForward.load(std::memory_order_relaxed))
+            {
+                // Use up the whole frame running, rather than waiting any of
+                // it. Unless waiting for a key, which no amount of running ends.
+                do
+                {
+                    ok = runFrame(ctx, UNTHROTTLED_CYCLES, &frame);
+                }
+                while (ok && !frame.waiting && pacerNow() < ctx->pacer.deadline);
+
+                carry = 0;
+            }
+            else
+            {
+                // Carry the remainder over to the next frame, so rates that are
+                // not a multiple of the frame rate still come out right over time.
+                const uint32_t speed = ctx->speed.load(std::memory_order_relaxed);
+                const uint64_t due   = carry + uint64_t(sys->cycleHz) * speed * frames;
+                carry = due % FRAME_HZ;
+                ok    = runFrame(ctx, due / FRAME_HZ, &frame);
+
+                if (ok && args->runAhead)
+                {
+                    runAhead(ctx, uint64_t(sys->cycleHz) * speed * args->runAhead / FRAME_HZ);
+                }
+            }
+
+            if (!ok)
+            {
+                reportFault(sys, frame.fault);
+                ctx->result = 1;
+                ctx->halted.store(true, std::memory_order_relaxed);
+                break;
+            }
+
+            if (sys->fbDirty)
+            {
+                tripleBufferPublish(&ctx->fb, sys->fb, sys->fbDirty);
+                sys->fbDirty = 0;
+            }
+
+            // Let the render thread block on input while waiting for a key,
+            // for as long as there is none it has queued since. Frames still
+            // run, to keep the timers going, but they are cheap then, so
+            // don't spin for precision.
+            const int64_t head = int64_t(ctx->input.head.load(std::memory_order_relaxed));
+            ctx->waitHead.store(frame.waiting ? head : -1, std::memory_order_release);
+
+            frames = pacerWait(&ctx->pacer, !frame.waiting);
+        }
+    }
+
     static const char* findBasename(const char* path)
     {
         const char* basename = path;
@@ -182,13 +505,23 @@ namespace c8e
         printf("Usage:\n");
         printf("\n");
         printf("  %s --help\n", basename);
-        printf("  %s [--log] [--step] <c8_path>\n", basename);
+        printf("  %s [--log] [--step] [--hz=<n>] [--speed=<n>x] [--unthrottled] [--stats] [--record=<path>] [--run-ahead=<n>] [--fg=<rrggbb>] [--bg=<rrggbb>] [--engine=<name>] [--quirks=<names>] <c8_path>\n", basename);
         printf("\n");
         printf("Arguments:\n");
         printf("\n");
         printf("  --help\tShow this help and exit.\n");
         printf("  --log \tPrint every instruction executed to stdout.\n");
         printf("  --step\tOnly cycle the CPU when space is pressed.\n");
+        printf("  --hz  \tInstructions to run per second (default %u).\n", unsigned(DEFAULT_CYCLE_HZ));
+        printf("  --speed\tMultiplier on --hz, from 1x to %ux. Halve or double it with - and =.\n", unsigned(MAX_SPEED));
+        printf("  --unthrottled\tRun as fast as possible, still presenting at 60 Hz. Or hold tab.\n");
+        printf("  --stats\tPrint frame pacing stats on exit.\n");
+        printf("  --record\tWrite the keys held to a file, as lines of the cycle and the keys in hex.\n");
+        printf("  --fg, --bg\tColors of pixels that are on and off, in hex (default ffffff and 000000).\n");
+        printf("  --run-ahead\tShow what the ROM will draw up to %u frames ahead, to hide its input lag.\n", unsigned(MAX_RUN_AHEAD));
+        printf("  --engine\tInterpreter to run the CPU with: switch (default), threaded, jit, aot, fused or table.\n");
+        printf("  --quirks\tComma separated CHIP-8 variant behaviors the ROM expects: vip, schip, or any of\n");
+        printf("          \tshift, loadstore, jump, clip, vfreset and dispwait. Needs the switch, threaded or fused engine.\n");
         printf("  c8_path\tPath to the CHIP-8 ROM to run.\n");
         printf("\n");
     }
@@ -215,7 +548,7 @@ namespace c8e
         return success;
     }
 
-    static void parseArgs(Args* args, int32_t argc, char** argv)
+    static bool parseArgs(Args* args, int32_t argc, char** argv)
     {
         for (int32_t i = 1; i < argc; ++i)
         {
@@ -237,22 +570,126 @@ namespace c8e
                 continue;
             }
 
+            if (strncmp(argv[i], "--hz=", 5) == 0)
+            {
+                char*      end;
+                const long hz = strtol(argv[i] + 5, &end, 10);
+
+                if (hz <= 0 || hz > long(UINT32_MAX >> 1) || *end)
+                {
+                    fprintf(stderr, "ERROR: Invalid rate %s.\n", argv[i] + 5);
+                    return false;
+                }
+
+                args->hz = uint32_t(hz);
+                continue;
+            }
+
+            if (strncmp(argv[i], "--speed=", 8) == 0)
+            {
+                char*      end;
+                const long speed = strtol(argv[i] + 8, &end, 10);
+
+                if (speed < 1 || speed > long(MAX_SPEED) || (*end && strcmp(end, "x") != 0))
+                {
+                    fprintf(stderr, "ERROR: Invalid speed %s.\n", argv[i] + 8);
+                    return false;
+                }
+
+                args->speed = uint32_t(speed);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--unthrottled") == 0)
+            {
+                args->unthrottled = true;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--record=", 9) == 0)
+            {
+                args->record = argv[i] + 9;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--run-ahead=", 12) == 0)
+            {
+                char*      end;
+                const long frames = strtol(argv[i] + 12, &end, 10);
+
+                if (frames < 1 || frames > long(MAX_RUN_AHEAD) || *end)
+                {
+                    fprintf(stderr, "ERROR: Invalid run-ahead %s.\n", argv[i] + 12);
+                    return false;
+                }
+
+                args->runAhead = uint32_t(frames);
+                continue;
+            }
+
+            if (strncmp(argv[i], "--fg=", 5) == 0 || strncmp(argv[i], "--bg=", 5) == 0)
+            {
+                char*               end;
+                const unsigned long rgb = strtoul(argv[i] + 5, &end, 16);
+
+                if (strlen(argv[i] + 5) != 6 || *end)
+                {
+                    fprintf(stderr, "ERROR: Invalid color %s.\n", argv[i] + 5);
+                    return false;
+                }
+
+                (argv[i][2] == 'f' ? args->fg : args->bg) = uint32_t(rgb);
+                continue;
+            }
+
+            if (strcmp(argv[i], "--stats") == 0)
+            {
+                args->stats = true;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--engine=", 9) == 0)
+            {
+                if (!parseEngine(argv[i] + 9, &args->engine))
+                {
+                    fprintf(stderr, "ERROR: Unknown engine %s.\n", argv[i] + 9);
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (strncmp(argv[i], "--quirks=", 9) == 0)
+            {
+                if (!parseQuirks(argv[i] + 9, &args->quirks))
+                {
+                    fprintf(stderr, "ERROR: Unknown quirks %s.\n", argv[i] + 9);
+                    return false;
+                }
+
+                continue;
+            }
+
             if (!args->path)
             {
                 args->path = argv[i];
             }
         }
+
+        return true;
     }
 
 } // namespace c8e
 
 int main(int argc, char** argv)
 {
-    srand(unsigned(time(nullptr)));
-
     // Parse arguments.
     c8e::Args args;
-    c8e::parseArgs(&args, argc, argv);
+
+    if (!c8e::parseArgs(&args, argc, argv))
+    {
+        return 1;
+    }
 
     if (args.help || !args.path)
     {
@@ -266,49 +703,126 @@ int main(int argc, char** argv)
 
     c8e::System sys;
     c8e::systemInit(&sys);
+    c8e::systemSeed(&sys, uint32_t(time(nullptr)));
     c8e::systemProgramMem(&sys, &programBuf, &programMaxSize);
 
-    if (!c8e::loadFileInto(argv[1], programBuf, programMaxSize))
+    if (!c8e::loadFileInto(args.path, programBuf, programMaxSize))
     {
-        fprintf(stderr, "ERROR: Failed to load ROM %s.\n", argv[1]);
+        fprintf(stderr, "ERROR: Failed to load ROM %s.\n", args.path);
+        return 1;
+    }
+
+    if (!c8e::systemSetEngine(&sys, args.engine))
+    {
+        fprintf(stderr, "ERROR: Engine not supported by this build, or for this ROM.\n");
+        return 1;
+    }
+
+    if (!c8e::systemSetQuirks(&sys, args.quirks))
+    {
+        fprintf(stderr, "ERROR: Quirks not supported by the engine.\n");
         return 1;
     }
 
     // Init rendering.
     c8e::RenderCtx render;
-    c8e::renderCtxInit(&render);
+    c8e::renderCtxInit(&render, args.fg, args.bg);
+
+    // Emulate on a thread of its own, so a slow present never holds up the
+    // CPU. This one takes input and presents whatever frame is the latest,
+    // at its own pace.
+    c8e::EmuCtx ctx;
+    ctx.sys           = &sys;
+    ctx.args          = &args;
+    ctx.result        = 0;
+    ctx.record        = nullptr;
+    ctx.runAheadNs    = 0;
+    ctx.runAheadMaxNs = 0;
+    ctx.aheadRows     = 0;
+    ctx.steps.store(0);
+    ctx.speed.store(args.speed);
+    ctx.fastForward.store(false);
+    ctx.quit.store(false);
+    ctx.halted.store(false);
+    ctx.waitHead.store(-1);
+    c8e::tripleBufferInit(&ctx.fb);
+    c8e::inputQueueInit(&ctx.input);
+
+    if (args.record && !(ctx.record = fopen(args.record, "w")))
+    {
+        fprintf(stderr, "ERROR: Failed to open %s for recording.\n", args.record);
+        return 1;
+    }
+
+    sys.cycleHz = args.hz;
+    std::thread emuThread(c8e::emulate, &ctx);
 
-    // Pump events.
     c8e::EventOpts opts;
-    while (c8e::processEvents(&render.window, &opts))
+    c8e::Pacer     pacer;
+    opts.speed = args.speed;
+    c8e::pacerInit(&pacer, c8e::FRAME_NS / c8e::INPUT_POLLS, 1);
+
+    bool run = true;
+
+    while (run && !ctx.halted.load(std::memory_order_relaxed))
     {
-        // Only step the CPU if manual stepping is turned off, or if the step
-        // button was pressed.
-        if (!args.step || opts.step)
+        // The last frame is published before the wait, so it's presented
+        // before blocking.
+        const int64_t tail  = int64_t(ctx.input.tail.load(std::memory_order_relaxed));
+        const bool    block = (ctx.waitHead.load(std::memory_order_acquire) == tail);
+
+        uint32_t dirty;
+
+        if (const c8e::System::Fb* fb = c8e::tripleBufferAcquire(&ctx.fb, &dirty))
         {
-            sys.keys = opts.keys;
-            c8e::CycleOpts cycle;
-            c8e::systemCycle(&sys, &cycle);
+            c8e::drawFb(&render, *fb, dirty);
+        }
 
-            if (cycle.fbUpdated)
-            {
-                c8e::drawFb(&render, sys.fb);
-            }
+        run = c8e::processEvents(&render.window, &ctx.input, &opts, block);
+        ctx.speed.store(opts.speed, std::memory_order_relaxed);
+        ctx.fastForward.store(opts.fastForward, std::memory_order_relaxed);
 
-            if (args.log)
-            {
-                char dasm[16];
-                c8e::systemDisasm(sys.op, dasm);
-                printf("%s\n", dasm);
-            }
+        if (opts.step)
+        {
+            ctx.steps.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (!block)
+        {
+            c8e::pacerWait(&pacer, false);
         }
+    }
 
-        // Rate limit.
-        constexpr int32_t CYCLE_HZ = 540;
+    ctx.quit.store(true, std::memory_order_relaxed);
+    emuThread.join();
 
-        struct timespec ts;
-        ts.tv_sec = 0;
-        ts.tv_nsec = 1000000000 / CYCLE_HZ;
-        nanosleep(&ts, nullptr);
+    if (ctx.record)
+    {
+        fclose(ctx.record);
     }
+
+    if (args.stats)
+    {
+        c8e::PacerStats stats;
+        c8e::pacerStats(&ctx.pacer, &stats);
+        printf("Frames: %llu, late: %llu, dropped: %llu\n", (unsigned long long)stats.waits,
+            (unsigned long long)stats.late, (unsigned long long)stats.dropped);
+        printf("Jitter: mean %.1f us, std dev %.1f us, max %.1f us\n", stats.jitterMean, stats.jitterStdDev,
+            stats.jitterMax);
+
+        if (args.runAhead)
+        {
+            const double frames = double(stats.waits ? stats.waits : 1);
+            printf("Run-ahead: mean %.1f us, max %.1f us per frame\n", double(ctx.runAheadNs) / frames / 1000.0,
+                double(ctx.runAheadMaxNs) / 1000.0);
+        }
+    }
+
+    if (args.engine == c8e::ENGINE_FUSED)
+    {
+        printf("Fused instruction groups executed: %llu\n", (unsigned long long)sys.numFused);
+    }
+
+    c8e::systemShutdown(&sys);
+    return ctx.result;
 }
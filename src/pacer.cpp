@@ -0,0 +1,113 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include "pacer.hpp"
+
+#include <cmath>
+
+#include "compat/time.hpp"
+
+namespace c8e
+{
+
+    static constexpr uint64_t NS_PER_SEC = 1000000000;
+    static constexpr uint64_t MIN_SPIN   = 100000;
+    static constexpr uint64_t INIT_SPIN  = 1000000;
+
+    static void sleepFor(uint64_t ns)
+    {
+        struct timespec ts;
+        ts.tv_sec  = time_t(ns / NS_PER_SEC);
+        ts.tv_nsec = long(ns % NS_PER_SEC);
+        nanosleep(&ts, nullptr);
+    }
+
+    uint64_t pacerNow()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * NS_PER_SEC + uint64_t(ts.tv_nsec);
+    }
+
+    void pacerInit(Pacer* pacer, uint64_t period, uint32_t maxCatchUp)
+    {
+        pacer->period      = period;
+        pacer->deadline    = pacerNow() + period;
+        pacer->spin        = (INIT_SPIN < period / 2 ? INIT_SPIN : period / 2);
+        pacer->maxCatchUp  = (maxCatchUp ? maxCatchUp : 1);
+        pacer->waits       = 0;
+        pacer->late        = 0;
+        pacer->dropped     = 0;
+        pacer->jitterMax   = 0;
+        pacer->jitterSum   = 0.0;
+        pacer->jitterSqSum = 0.0;
+    }
+
+    uint32_t pacerWait(Pacer* pacer, bool spin)
+    {
+        uint64_t now = pacerNow();
+
+        if (!spin && now < pacer->deadline)
+        {
+            sleepFor(pacer->deadline - now);
+            now = pacerNow();
+        }
+
+        // Sleep until the last stretch, then spin through it. The spin adapts
+        // to how far sleeps have overshot lately, shrinking slowly back when
+        // they stop, so it costs as little CPU as the host's timers allow.
+        if (now + pacer->spin < pacer->deadline)
+        {
+            const uint64_t wake = pacer->deadline - pacer->spin;
+            sleepFor(wake - now);
+            now = pacerNow();
+
+            const uint64_t overshoot = (now > wake ? now - wake : 0);
+            const uint64_t decayed   = pacer->spin - pacer->spin / 64;
+            const uint64_t needed    = overshoot + overshoot / 4;
+            const uint64_t spin      = (needed > decayed ? needed : decayed);
+
+            pacer->spin = (spin < MIN_SPIN ? MIN_SPIN : spin > pacer->period / 2 ? pacer->period / 2 : spin);
+        }
+
+        while (spin && now < pacer->deadline)
+        {
+            now = pacerNow();
+        }
+
+        const uint64_t jitter = (now > pacer->deadline ? now - pacer->deadline : 0);
+
+        ++pacer->waits;
+        pacer->jitterMax    = (jitter > pacer->jitterMax ? jitter : pacer->jitterMax);
+        pacer->jitterSum   += double(jitter);
+        pacer->jitterSqSum += double(jitter) * double(jitter);
+
+        // Any whole periods past the deadline are due as well. Catch up on a
+        // few, and drop the rest rather than falling further behind.
+        const uint64_t due    = 1 + jitter / pacer->period;
+        const uint64_t caught = (due < pacer->maxCatchUp ? due : pacer->maxCatchUp);
+
+        pacer->late     += (due > 1 ? 1 : 0);
+        pacer->dropped  += due - caught;
+        pacer->deadline += due * pacer->period;
+
+        return uint32_t(caught);
+    }
+
+    void pacerStats(const Pacer* pacer, PacerStats* o_stats)
+    {
+        const double waits    = double(pacer->waits ? pacer->waits : 1);
+        const double mean     = pacer->jitterSum / waits;
+        const double variance = pacer->jitterSqSum / waits - mean * mean;
+
+        o_stats->waits        = pacer->waits;
+        o_stats->late         = pacer->late;
+        o_stats->dropped      = pacer->dropped;
+        o_stats->jitterMean   = mean / 1000.0;
+        o_stats->jitterStdDev = (variance > 0.0 ? std::sqrt(variance) : 0.0) / 1000.0;
+        o_stats->jitterMax    = double(pacer->jitterMax) / 1000.0;
+    }
+
+} // namespace c8e
@@ -0,0 +1,56 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <cstdint>
+
+namespace c8e
+{
+
+    // Paces a loop to a fixed period against absolute deadlines, so time
+    // spent in the loop comes out of the wait instead of adding up. Waits by
+    // sleeping most of the way and spinning the rest, as sleeps overshoot.
+    struct Pacer
+    {
+        uint64_t period;     // Nanoseconds.
+        uint64_t deadline;   // When the next period starts.
+        uint64_t spin;       // How long before the deadline to stop sleeping.
+        uint32_t maxCatchUp; // Most periods to report as due at once.
+
+        // Stats, where jitter is how late a wait returned past its deadline.
+        uint64_t waits;
+        uint64_t late;       // Waits that returned a period or more late.
+        uint64_t dropped;    // Periods that were past due and skipped.
+        uint64_t jitterMax;
+        double   jitterSum;
+        double   jitterSqSum;
+    };
+
+    struct PacerStats
+    {
+        uint64_t waits;
+        uint64_t late;
+        uint64_t dropped;
+        double   jitterMean;   // Microseconds.
+        double   jitterStdDev; // Microseconds.
+        double   jitterMax;    // Microseconds.
+    };
+
+    // Monotonic time in nanoseconds.
+    uint64_t pacerNow();
+
+    // The first period starts now.
+    void pacerInit(Pacer* pacer, uint64_t period, uint32_t maxCatchUp);
+
+    // Waits until the next period starts, and returns how many periods are
+    // due. That is one unless the loop fell behind, in which case up to
+    // `maxCatchUp` are for the caller to catch up with, and the rest dropped.
+    // Without `spin` it only sleeps, which is cheaper but less precise.
+    uint32_t pacerWait(Pacer* pacer, bool spin);
+
+    void pacerStats(const Pacer* pacer, PacerStats* o_stats);
+
+} // namespace c8e
@@ -0,0 +1,104 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include "parse.hpp"
+
+#include <cstring>
+
+namespace c8e
+{
+
+    bool parseEngine(const char* name, Engine* o_engine)
+    {
+        if (strcmp(name, "switch") == 0)
+        {
+            *o_engine = ENGINE_SWITCH;
+            return true;
+        }
+
+        if (strcmp(name, "threaded") == 0)
+        {
+            *o_engine = ENGINE_THREADED;
+            return true;
+        }
+
+        if (strcmp(name, "jit") == 0)
+        {
+            *o_engine = ENGINE_JIT;
+            return true;
+        }
+
+        if (strcmp(name, "aot") == 0)
+        {
+            *o_engine = ENGINE_AOT;
+            return true;
+        }
+
+        if (strcmp(name, "fused") == 0)
+        {
+            *o_engine = ENGINE_FUSED;
+            return true;
+        }
+
+        if (strcmp(name, "table") == 0)
+        {
+            *o_engine = ENGINE_TABLE;
+            return true;
+        }
+
+        return false;
+    }
+
+    struct QuirkName
+    {
+        const char* name;
+        uint8_t     quirks;
+    };
+
+    static const QuirkName QUIRK_NAMES[] =
+    {
+        {"vip",       QUIRK_SHIFT_VY | QUIRK_INC_I | QUIRK_CLIP_SPRITES | QUIRK_VF_RESET | QUIRK_DISPLAY_WAIT},
+        {"schip",     QUIRK_JUMP_VX | QUIRK_CLIP_SPRITES},
+        {"shift",     QUIRK_SHIFT_VY},
+        {"loadstore", QUIRK_INC_I},
+        {"jump",      QUIRK_JUMP_VX},
+        {"clip",      QUIRK_CLIP_SPRITES},
+        {"vfreset",   QUIRK_VF_RESET},
+        {"dispwait",  QUIRK_DISPLAY_WAIT},
+    };
+
+    bool parseQuirks(const char* names, uint8_t* o_quirks)
+    {
+        uint8_t quirks = 0;
+
+        while (*names)
+        {
+            const char*  end = strchr(names, ',');
+            const size_t len = (end ? size_t(end - names) : strlen(names));
+            bool         found = false;
+
+            for (const QuirkName& quirk : QUIRK_NAMES)
+            {
+                if (strlen(quirk.name) == len && strncmp(quirk.name, names, len) == 0)
+                {
+                    quirks |= quirk.quirks;
+                    found   = true;
+                    break;
+                }
+            }
+
+            if (!found)
+            {
+                return false;
+            }
+
+            names += len + (end ? 1 : 0);
+        }
+
+        *o_quirks = quirks;
+        return true;
+    }
+
+} // namespace c8e
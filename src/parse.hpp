@@ -0,0 +1,21 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include "system.hpp"
+
+namespace c8e
+{
+
+    // Parses an engine name, as given to --engine.
+    bool parseEngine(const char* name, Engine* o_engine);
+
+    // Parses comma separated quirk names and presets, as given to --quirks.
+    bool parseQuirks(const char* names, uint8_t* o_quirks);
+
+} // namespace c8e
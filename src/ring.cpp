@@ -0,0 +1,230 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <cstring>
+#include <thread>
+
+#if !defined(_WIN32)
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+#include "ring.hpp"
+
+namespace c8e
+{
+
+    static_assert(sizeof(RingHeader) <= RING_RECORDS_AT, "ring header overlaps the records");
+    static_assert(sizeof(RingRecord) % alignof(RingRecord) == 0, "ring records must pack without gaps");
+
+    static size_t ringSize(uint32_t numSlots)
+    {
+        return RING_RECORDS_AT + size_t(numSlots) * sizeof(RingRecord);
+    }
+
+    static void mapped(Ring* ring, void* mem, size_t size)
+    {
+        ring->header  = static_cast<RingHeader*>(mem);
+        ring->records = reinterpret_cast<RingRecord*>(static_cast<uint8_t*>(mem) + RING_RECORDS_AT);
+        ring->size    = size;
+    }
+
+    static uint8_t timerValue(const System* sys, uint64_t end)
+    {
+        // As the CPU reads its timers.
+        const uint64_t tick = sys->cycles * 60 / sys->cycleHz;
+        return uint8_t(end > tick ? end - tick : 0);
+    }
+
+#if defined(_WIN32)
+
+    bool ringCreate(Ring* ring, const char*, uint32_t)
+    {
+        memset(ring, 0, sizeof(*ring));
+        return false;
+    }
+
+    bool ringOpen(Ring* ring, const char*)
+    {
+        memset(ring, 0, sizeof(*ring));
+        return false;
+    }
+
+    void ringClose(Ring* ring)
+    {
+        memset(ring, 0, sizeof(*ring));
+    }
+
+#else
+
+    bool ringCreate(Ring* ring, const char* name, uint32_t numSlots)
+    {
+        memset(ring, 0, sizeof(*ring));
+
+        if (!numSlots)
+        {
+            return false;
+        }
+
+        const int32_t fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        const size_t size = ringSize(numSlots);
+        void*        mem  = MAP_FAILED;
+
+        if (ftruncate(fd, off_t(size)) == 0)
+        {
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+
+        if (mem == MAP_FAILED)
+        {
+            return false;
+        }
+
+        memset(mem, 0, size);
+        mapped(ring, mem, size);
+
+        ring->header->recordSize = sizeof(RingRecord);
+        ring->header->numSlots   = numSlots;
+        ring->header->head.store(0, std::memory_order_relaxed);
+
+        // Last, so that readers that find the magic find the rest too.
+        std::atomic_thread_fence(std::memory_order_release);
+        ring->header->magic = RING_MAGIC;
+        return true;
+    }
+
+    bool ringOpen(Ring* ring, const char* name)
+    {
+        memset(ring, 0, sizeof(*ring));
+
+        const int32_t fd = shm_open(name, O_RDONLY, 0);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat info;
+        void*       mem = MAP_FAILED;
+
+        if (fstat(fd, &info) == 0 && size_t(info.st_size) >= RING_RECORDS_AT)
+        {
+            mem = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+
+        if (mem == MAP_FAILED)
+        {
+            return false;
+        }
+
+        mapped(ring, mem, size_t(info.st_size));
+        const RingHeader* header = ring->header;
+
+        if (header->magic != RING_MAGIC || header->recordSize != sizeof(RingRecord) || ringSize(header->numSlots) > ring->size)
+        {
+            ringClose(ring);
+            return false;
+        }
+
+        return true;
+    }
+
+    void ringClose(Ring* ring)
+    {
+        if (ring->header)
+        {
+            munmap(ring->header, ring->size);
+        }
+
+        memset(ring, 0, sizeof(*ring));
+    }
+
+#endif // defined(_WIN32)
+
+    void ringPublish(Ring* ring, uint32_t instance, const System* sys)
+    {
+        const uint64_t n       = ring->header->head.fetch_add(1, std::memory_order_relaxed);
+        const uint64_t writing = 2 * n + 1;
+        RingRecord*    record  = &ring->records[n % ring->header->numSlots];
+        uint64_t       seq     = record->seq.load(std::memory_order_relaxed);
+
+        // Only write over older records. One that's still being written is
+        // waited for, which is short of a writer being descheduled; one that's
+        // newer means the ring came around while this one was claimed, and
+        // this record is dropped rather than torn.
+        for (;;)
+        {
+            if (seq >= writing)
+            {
+                return;
+            }
+
+            if (seq & 1)
+            {
+                std::this_thread::yield();
+                seq = record->seq.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (record->seq.compare_exchange_weak(seq, writing, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_release);
+
+        record->instance = instance;
+        record->I        = sys->I;
+        record->pc       = sys->pc;
+        memcpy(record->fb, sys->fb, sizeof(record->fb));
+        record->cycles   = sys->cycles;
+        record->keys     = sys->keys;
+        memcpy(record->V, sys->V, sizeof(record->V));
+        record->sp       = sys->sp;
+        record->delay    = timerValue(sys, sys->delayEnd);
+        record->sound    = timerValue(sys, sys->soundEnd);
+
+        record->seq.store(writing + 1, std::memory_order_release);
+    }
+
+    bool ringRead(const Ring* ring, uint64_t n, RingRecord* o_record)
+    {
+        const RingRecord* record    = &ring->records[n % ring->header->numSlots];
+        const uint64_t    published = 2 * n + 2;
+
+        if (record->seq.load(std::memory_order_acquire) != published)
+        {
+            return false;
+        }
+
+        // Everything but `seq`, which comes first.
+        memcpy(reinterpret_cast<uint8_t*>(o_record) + sizeof(o_record->seq),
+            reinterpret_cast<const uint8_t*>(record) + sizeof(record->seq), sizeof(RingRecord) - sizeof(record->seq));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (record->seq.load(std::memory_order_relaxed) != published)
+        {
+            return false;
+        }
+
+        o_record->seq.store(published, std::memory_order_relaxed);
+        return true;
+    }
+
+} // namespace c8e
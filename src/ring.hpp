@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "system.hpp"
+
+namespace c8e
+{
+
+    constexpr uint32_t RING_MAGIC         = 0x52453843; // "C8ER", little endian.
+    constexpr uint32_t RING_DEFAULT_SLOTS = 1024;
+    constexpr size_t   RING_RECORDS_AT    = 64; // Byte offset of the first record, after the header.
+
+    // A frame as published to a ring: the framebuffer, and the state of the
+    // CPU when it was taken. Readers in other languages can rely on this
+    // layout, little endian with natural alignment.
+    struct RingRecord
+    {
+        // 2 * n + 2 once record `n` is in the slot, and odd while a record
+        // is being written to it.
+        std::atomic<uint64_t> seq;
+
+        uint32_t   instance; // Which system published it; the job's index for c8e-batch.
+        uint16_t   I;
+        uint16_t   pc;
+        System::Fb fb;
+        uint64_t   cycles;
+        uint16_t   keys;
+        uint8_t    V[16];
+        int8_t     sp;
+        uint8_t    delay; // Timer values, as FX07 would read the delay timer.
+        uint8_t    sound;
+    };
+
+    struct RingHeader
+    {
+        uint32_t              magic;
+        uint32_t              recordSize; // sizeof(RingRecord), for readers to check.
+        uint32_t              numSlots;
+        std::atomic<uint64_t> head; // Records published so far, or being published.
+    };
+
+    // A ring of records in POSIX shared memory, that any number of systems
+    // publish frames to, and that other processes read without copying them
+    // through pipes. Record `n` goes into slot `n % numSlots`, overwriting
+    // what was there; each slot is guarded by its sequence number as a
+    // seqlock, so readers can tell a torn or overwritten record and skip it.
+    //
+    // Rings outlive the process that created them, for readers to attach to
+    // after a short run, until removed with shm_unlink.
+    struct Ring
+    {
+        RingHeader* header;
+        RingRecord* records;
+        size_t      size;
+    };
+
+    bool ringCreate(Ring* ring, const char* name, uint32_t numSlots); // Clears the ring if it already exists.
+    bool ringOpen(Ring* ring, const char* name);
+    void ringClose(Ring* ring);
+
+    // Publishes the system's current frame. Safe to call from several threads
+    // at once.
+    void ringPublish(Ring* ring, uint32_t instance, const System* sys);
+
+    // Reads record `n`. Returns false if it's not published yet, or has been
+    // overwritten.
+    bool ringRead(const Ring* ring, uint64_t n, RingRecord* o_record);
+
+} // namespace c8e
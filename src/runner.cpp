@@ -0,0 +1,149 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include "runner.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+
+#include "ring.hpp"
+
+namespace c8e
+{
+
+    static const char* const EXIT_NAMES[] =
+    {
+        "budget",
+        "fb_updated",
+        "wait_key",
+        "unknown_op",
+        "stack_fault",
+    };
+
+    // Reads the next line of input. Returns false at the end.
+    static bool readInput(FILE* file, uint64_t* o_cycle, uint16_t* o_keys)
+    {
+        unsigned long long cycle;
+        unsigned           keys;
+
+        if (!file || fscanf(file, "%llu %x", &cycle, &keys) != 2)
+        {
+            return false;
+        }
+
+        *o_cycle = cycle;
+        *o_keys  = uint16_t(keys);
+        return true;
+    }
+
+    // The cycle the next timer tick, and so the next frame, starts at.
+    static uint64_t nextFrame(const System* sys)
+    {
+        const uint64_t tick = sys->cycles * 60 / sys->cycleHz;
+        return ((tick + 1) * sys->cycleHz + 59) / 60;
+    }
+
+    const char* runnerBasename(const char* path)
+    {
+        const char* basename = path;
+
+        for (const char* ch = path; *ch; ++ch)
+        {
+            if (*ch == '/')
+            {
+                basename = ch + 1;
+            }
+        }
+
+        return basename;
+    }
+
+    const char* runnerExitName(RunExit exit)
+    {
+        return EXIT_NAMES[exit];
+    }
+
+    bool runnerParseNumber(const char* str, uint64_t* o_value)
+    {
+        // strtoull skips whitespace and negates a leading '-', so insist on a digit.
+        if (*str < '0' || *str > '9')
+        {
+            return false;
+        }
+
+        char* end;
+        errno    = 0;
+        *o_value = strtoull(str, &end, 10);
+        return errno != ERANGE && !*end;
+    }
+
+    bool runnerLoadFile(const char* path, void* buffer, uint16_t maxSize)
+    {
+        bool success = false;
+
+        if (FILE* file = fopen(path, "rb"))
+        {
+            fseek(file, 0, SEEK_END);
+            const size_t size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+
+            if (size && size <= maxSize)
+            {
+                const size_t read = fread(buffer, 1, size, file);
+                success = (read == size);
+            }
+
+            fclose(file);
+        }
+
+        return success;
+    }
+
+    bool runnerRun(System* sys, uint64_t end, FILE* input, Ring* ring, uint32_t instance, RunExit* o_exit)
+    {
+        uint64_t at;
+        uint16_t keys;
+        bool     pending = readInput(input, &at, &keys);
+
+        *o_exit = RUN_BUDGET;
+
+        while (sys->cycles < end)
+        {
+            while (pending && at <= sys->cycles)
+            {
+                sys->keys = keys;
+                pending   = readInput(input, &at, &keys);
+            }
+
+            const uint64_t frame = (ring ? nextFrame(sys) : end);
+            uint64_t       until = (pending && at < end ? at : end);
+            until = (frame < until ? frame : until);
+
+            RunResult result;
+            systemRun(sys, until - sys->cycles, &result);
+            *o_exit = result.exit;
+
+            if (result.idle)
+            {
+                // Nothing changes until the next tick, so skip to it.
+                const uint64_t tick = nextFrame(sys);
+                sys->cycles = (tick < until ? tick : until);
+            }
+
+            if (result.exit == RUN_UNKNOWN_OP || result.exit == RUN_STACK_FAULT)
+            {
+                return false;
+            }
+
+            if (ring && sys->cycles >= frame)
+            {
+                ringPublish(ring, instance, sys);
+            }
+        }
+
+        return true;
+    }
+
+} // namespace c8e
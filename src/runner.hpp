@@ -0,0 +1,33 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include "system.hpp"
+
+namespace c8e
+{
+
+    struct Ring;
+
+    // What c8e-headless and c8e-batch have in common: running a ROM without
+    // a window, for a fixed number of cycles, with keys replayed from a file.
+
+    const char* runnerBasename(const char* path);
+    const char* runnerExitName(RunExit exit); // As the tools print it.
+    bool runnerParseNumber(const char* str, uint64_t* o_value); // Decimal, and nothing after it.
+    bool runnerLoadFile(const char* path, void* buffer, uint16_t maxSize);
+
+    // Runs until cycle `end`, pressing keys as `input` says, and publishing
+    // each frame to `ring` as `instance` if there is a ring. Returns false on
+    // a fault. Waiting for a key is not one; the cycles pass while waiting.
+    // With System::stopIdle set, cycles spent idle until a timer tick are
+    // skipped rather than run.
+    bool runnerRun(System* sys, uint64_t end, FILE* input, Ring* ring, uint32_t instance, RunExit* o_exit);
+
+} // namespace c8e
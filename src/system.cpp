@@ -3,14 +3,12 @@
 // License: https://opensource.org/licenses/ISC
 //
 
-#include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
-#include "compat/time.hpp"
-
+#include "jit.hpp"
 #include "system.hpp"
 
 namespace c8e
@@ -42,6 +40,41 @@ namespace c8e
         return N;
     }
 
+    // Compile-time integer sequence, as C++11 has none. Built by doubling
+    // rather than one element at a time, to keep the instantiation depth down
+    // for long sequences.
+    template<uint32_t... Is>
+    struct IndexSeq
+    {
+    };
+
+    template<class A, class B>
+    struct ConcatSeq;
+
+    template<uint32_t... As, uint32_t... Bs>
+    struct ConcatSeq<IndexSeq<As...>, IndexSeq<Bs...>>
+    {
+        using Type = IndexSeq<As..., (sizeof...(As) + Bs)...>;
+    };
+
+    template<uint32_t N>
+    struct MakeSeq
+    {
+        using Type = typename ConcatSeq<typename MakeSeq<N / 2>::Type, typename MakeSeq<N - N / 2>::Type>::Type;
+    };
+
+    template<>
+    struct MakeSeq<0>
+    {
+        using Type = IndexSeq<>;
+    };
+
+    template<>
+    struct MakeSeq<1>
+    {
+        using Type = IndexSeq<0>;
+    };
+
     static void drawHorizLine(System* sys, uint8_t x, uint8_t y, uint8_t w, uint8_t px)
     {
         const uint64_t mask = (uint64_t(px) << (64 - w)) >> x;
@@ -53,386 +86,1615 @@ namespace c8e
             sys->VF = 1;
         }
 
-        sys->fb[y] = res;
+        sys->fb[y]     = res;
+        sys->fbDirty |= uint32_t(mask != 0) << y;
     }
 
-    static void fetchOpCode(System* sys)
+    enum OpKind : uint8_t
     {
-        const uint16_t hi = sys->mem[sys->pc++];
-        const uint16_t lo = sys->mem[sys->pc++];
-        sys->op = (hi << 8) | lo;
-    }
+        OP_NONE,
+        OP_00E0,
+        OP_00EE,
+        OP_0NNN,
+        OP_1NNN,
+        OP_2NNN,
+        OP_3XNN,
+        OP_4XNN,
+        OP_5XY0,
+        OP_6XNN,
+        OP_7XNN,
+        OP_8XY0,
+        OP_8XY1,
+        OP_8XY2,
+        OP_8XY3,
+        OP_8XY4,
+        OP_8XY5,
+        OP_8XY6,
+        OP_8XY7,
+        OP_8XYE,
+        OP_9XY0,
+        OP_ANNN,
+        OP_BNNN,
+        OP_CXNN,
+        OP_DXYN,
+        OP_EX9E,
+        OP_EXA1,
+        OP_FX07,
+        OP_FX0A,
+        OP_FX15,
+        OP_FX18,
+        OP_FX1E,
+        OP_FX29,
+        OP_FX33,
+        OP_FX55,
+        OP_FX65,
+        OP_UNKNOWN,
+        OP_COUNT,
+
+        // Groups of instructions executed as one, by ENGINE_FUSED only. The
+        // head of the group is decoded as one of these, while the rest keep
+        // their own entries.
+        OP_FUSED_6XNN_6XNN_DXYN = OP_COUNT,
+        OP_FUSED_ANNN_DXYN,
+        OP_FUSED_7XNN_3XNN_1NNN,
+        OP_FUSED_FX07_3XNN_1NNN,
+    };
 
-    static void execOpCode(System* sys, CycleOpts* o_opts)
+    // Upper bound of instructions executed by a fused group.
+    static constexpr uint32_t MAX_FUSED_OPS = 3;
+
+    static constexpr OpKind decodeKind8XYN(uint8_t n)
     {
-        switch (sys->op & 0xF000)
-        {
-            case 0x0000:
-                switch (sys->op)
-                {
-                    case 0x00E0: // 0x00E0 : Clears the screen.
-                        memset(sys->fb, 0, sizeof(sys->fb));
-                        o_opts->fbUpdated = true;
-                        break;
+        return (n <= 0x7 ? OpKind(OP_8XY0 + n) : n == 0xE ? OP_8XYE : OP_UNKNOWN);
+    }
 
-                    case 0x00EE: // 0x00EE : Returns from a subroutine.
-                        sys->pc = sys->stack[--(sys->sp)];
-                        break;
+    static constexpr OpKind decodeKindFXNN(uint8_t nn)
+    {
+        return (nn == 0x07 ? OP_FX07 :
+                nn == 0x0A ? OP_FX0A :
+                nn == 0x15 ? OP_FX15 :
+                nn == 0x18 ? OP_FX18 :
+                nn == 0x1E ? OP_FX1E :
+                nn == 0x29 ? OP_FX29 :
+                nn == 0x33 ? OP_FX33 :
+                nn == 0x55 ? OP_FX55 :
+                nn == 0x65 ? OP_FX65 :
+                             OP_UNKNOWN);
+    }
 
-                    default:     // 0x0NNN : Jump to a machine code routine at nnn. (ignored)
-                        break;
-                }
+    // Written as a single expression so that it can be evaluated at compile
+    // time, to build the opcode table for ENGINE_TABLE.
+    static constexpr uint8_t decodeKind(uint16_t op)
+    {
+        return ((op & 0xF000) == 0x0000 ? (op == 0x00E0 ? OP_00E0 : op == 0x00EE ? OP_00EE : OP_0NNN) :
+                (op & 0xF000) == 0x1000 ? OP_1NNN :
+                (op & 0xF000) == 0x2000 ? OP_2NNN :
+                (op & 0xF000) == 0x3000 ? OP_3XNN :
+                (op & 0xF000) == 0x4000 ? OP_4XNN :
+                (op & 0xF000) == 0x5000 ? OP_5XY0 :
+                (op & 0xF000) == 0x6000 ? OP_6XNN :
+                (op & 0xF000) == 0x7000 ? OP_7XNN :
+                (op & 0xF000) == 0x8000 ? decodeKind8XYN(op & 0x000F) :
+                (op & 0xF000) == 0x9000 ? OP_9XY0 :
+                (op & 0xF000) == 0xA000 ? OP_ANNN :
+                (op & 0xF000) == 0xB000 ? OP_BNNN :
+                (op & 0xF000) == 0xC000 ? OP_CXNN :
+                (op & 0xF000) == 0xD000 ? OP_DXYN :
+                (op & 0xF000) == 0xE000 ? ((op & 0x00FF) == 0x9E ? OP_EX9E : (op & 0x00FF) == 0xA1 ? OP_EXA1 : OP_UNKNOWN) :
+                                          decodeKindFXNN(op & 0x00FF));
+    }
 
-                break;
+    static void decodeOpCode(uint16_t op, Instr* o_instr)
+    {
+        o_instr->op   = op;
+        o_instr->nnn  = (op & 0x0FFF);
+        o_instr->kind = decodeKind(op);
+        o_instr->x    = (op & 0x0F00) >> 8;
+        o_instr->y    = (op & 0x00F0) >> 4;
+        o_instr->nn   = (op & 0x00FF);
+    }
 
-            case 0x1000: // 0x1NNN : Jumps to address NNN.
-                sys->pc = sys->op & 0x0FFF;
-                break;
+    static uint8_t plainKind(const Instr& instr)
+    {
+        return (instr.kind < OP_COUNT ? instr.kind : decodeKind(instr.op));
+    }
 
-            case 0x2000: // 0x2NNN : Calls subroutine at NNN.
-                sys->stack[(sys->sp)++] = sys->pc;
-                sys->pc = sys->op & 0x0FFF;
-                break;
+    // Notes which bytes in the range, as they are now, no longer hold the
+    // code the AOT program was translated from. The translation runs only
+    // while none do, so it picks up again once the code is written back, as
+    // when rolling back to before a write.
+    static void updateAotStale(System* sys, uint16_t addr, uint16_t size)
+    {
+        const AotProgram* aot = sys->aot;
+        const uint32_t    end = (uint32_t(addr) + size < sizeof(sys->mem) ? uint32_t(addr) + size : sizeof(sys->mem));
 
-            case 0x3000: // 0x3XNN : Skips the next instruction if VX equals NN.
-            {
-                const uint8_t reg = (sys->op & 0x0F00) >> 8;
-                const uint8_t val = (sys->op & 0x00FF);
-                sys->pc += (sys->V[reg] == val ? 2 : 0);
-                break;
-            }
+        for (uint32_t i = addr; i < end; ++i)
+        {
+            const uint8_t bit = uint8_t(1 << (i % 8));
 
-            case 0x4000: // 0x4XNN : Skips the next instruction if VX doesn't equal NN.
+            if (aot->codeMap[i / 8] & bit)
             {
-                const uint8_t reg = (sys->op & 0x0F00) >> 8;
-                const uint8_t val = (sys->op & 0x00FF);
-                sys->pc += (sys->V[reg] == val ? 0 : 2);
-                break;
-            }
+                // Code outside the ROM was translated from memory that isn't
+                // kept, so it stays stale once written.
+                const bool inRom = (i >= 0x200 && i - 0x200 < aot->romSize);
+                const bool stale = !inRom || sys->mem[i] != aot->rom[i - 0x200];
 
-            case 0x5000: // 0x5XY0 : Skips the next instruction if VX equals VY.
-            {
-                const uint8_t regX = (sys->op & 0x0F00) >> 8;
-                const uint8_t regY = (sys->op & 0x00F0) >> 4;
-                sys->pc += (sys->V[regX] == sys->V[regY] ? 2 : 0);
-                break;
+                if (stale != ((sys->aotStale[i / 8] & bit) != 0))
+                {
+                    sys->aotStale[i / 8] ^= bit;
+                    sys->numAotStale     += (stale ? 1 : -1);
+                }
             }
+        }
+    }
 
-            case 0x6000: // 0x6XNN : Sets VX to NN.
-            {
-                const uint8_t reg = (sys->op & 0x0F00) >> 8;
-                const uint8_t val = (sys->op & 0x00FF);
-                sys->V[reg] = val;
-                break;
-            }
+    static void invalidateCode(System* sys, uint16_t addr, uint16_t size)
+    {
+        // An instruction at the even address below `addr` overlaps it too,
+        // as does any fused group starting up to two instructions before.
+        const uint32_t from  = (addr > 2 * (MAX_FUSED_OPS - 1) ? addr - 2 * (MAX_FUSED_OPS - 1) : 0);
+        const uint32_t first = from / 2;
+        const uint32_t last  = (uint32_t(addr) + size + 1) / 2;
+        const uint32_t end   = (last < arrSize(sys->decoded) ? last : arrSize(sys->decoded));
+
+        for (uint32_t i = first; i < end; ++i)
+        {
+            sys->decoded[i].kind = OP_NONE;
+        }
 
-            case 0x7000: // 0x7XNN : Adds NN to VX. (Carry flag is not changed)
-            {
-                const uint8_t reg = (sys->op & 0x0F00) >> 8;
-                const uint8_t val = (sys->op & 0x00FF);
-                sys->V[reg] += val;
-                break;
-            }
+        if (sys->jit)
+        {
+            jitInvalidate(sys->jit, addr, size);
+        }
 
-            case 0x8000:
-            {
-                const uint8_t regX = (sys->op & 0x0F00) >> 8;
-                const uint8_t regY = (sys->op & 0x00F0) >> 4;
+        if (sys->aot)
+        {
+            updateAotStale(sys, addr, size);
+        }
+    }
 
-                switch (sys->op & 0x000F)
-                {
-                    case 0x0000: // 0x8XY0 : Sets VX to the value of VY.
-                        sys->V[regX] = sys->V[regY];
-                        break;
+    // I may point anywhere up to 0xFFFF, so memory accessed through it wraps
+    // around at the end, rather than reaching past it.
+    static uint16_t wrapAddr(uint32_t addr)
+    {
+        return uint16_t(addr % sizeof(System::mem));
+    }
 
-                    case 0x0001: // 0x8XY1 : Sets VX to VX or VY. (Bitwise OR operation)
-                        sys->V[regX] |= sys->V[regY];
-                        break;
+    // As invalidateCode, for a range that may wrap around.
+    static void invalidateWrapped(System* sys, uint32_t addr, uint16_t size)
+    {
+        const uint16_t first = wrapAddr(addr);
+        const uint16_t room  = uint16_t(sizeof(sys->mem) - first);
 
-                    case 0x0002: // 0x8XY2 : Sets VX to VX and VY. (Bitwise AND operation)
-                        sys->V[regX] &= sys->V[regY];
-                        break;
+        invalidateCode(sys, first, size < room ? size : room);
 
-                    case 0x0003: // 0x8XY3 : Sets VX to VX xor VY.
-                        sys->V[regX] ^= sys->V[regY];
-                        break;
+        if (size > room)
+        {
+            invalidateCode(sys, 0, size - room);
+        }
+    }
 
-                    case 0x0004: // 0x8XY4 : Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
-                    {
-                        const uint16_t res = sys->V[regX] + sys->V[regY];
-                        sys->V[regX] = uint8_t(res);
-                        sys->VF      = (res >> 8 ? 1 : 0);
-                        break;
-                    }
+    static const Instr* decodedAt(System* sys, uint32_t index)
+    {
+        Instr* instr = &sys->decoded[index];
 
-                    case 0x0005: // 0x8XY5 : VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-                    {
-                        const uint16_t res = sys->V[regX] - sys->V[regY];
-                        sys->V[regX] = uint8_t(res);
-                        sys->VF      = (res >> 8 ? 0 : 1);
-                        break;
-                    }
+        if (instr->kind == OP_NONE)
+        {
+            const uint16_t hi = sys->mem[index * 2 + 0];
+            const uint16_t lo = sys->mem[index * 2 + 1];
+            decodeOpCode((hi << 8) | lo, instr);
+        }
 
-                    case 0x0006: // 0x8XY6 : Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
-                        sys->VF        = (sys->V[regX] & 1);
-                        sys->V[regX] >>= 1;
-                        break;
+        return instr;
+    }
 
-                    case 0x0007: // 0x8XY7 : Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-                    {
-                        const uint16_t res = sys->V[regY] - sys->V[regX];
-                        sys->V[regX] = uint8_t(res);
-                        sys->VF      = (res >> 8 ? 0 : 1);
-                        break;
-                    }
+    // Turns the freshly decoded entry at `index` into the head of a fused
+    // group, if it starts one.
+    static void fuseInstr(System* sys, uint32_t index)
+    {
+        if (index + MAX_FUSED_OPS > arrSize(sys->decoded))
+        {
+            return;
+        }
 
-                    case 0x000E: // 0x8XYE : Stores the most significant bit of VX in VF and then shifts VX to the left by 1.
-                        sys->VF        = (sys->V[regX] & 0x80) >> 7;
-                        sys->V[regX] <<= 1;
-                        break;
+        Instr*        head = &sys->decoded[index];
+        const uint8_t b    = plainKind(*decodedAt(sys, index + 1));
 
-                    default:
-                        goto unknown_op;
+        switch (head->kind)
+        {
+            case OP_6XNN:
+                if (b == OP_6XNN && plainKind(*decodedAt(sys, index + 2)) == OP_DXYN)
+                {
+                    head->kind = OP_FUSED_6XNN_6XNN_DXYN;
                 }
 
                 break;
-            }
 
-            case 0x9000: // 0x9XY0 : Skips the next instruction if VX doesn't equal VY.
-            {
-                const uint8_t regX = (sys->op & 0x0F00) >> 8;
-                const uint8_t regY = (sys->op & 0x00F0) >> 4;
-                sys->pc += (regX == regY ? 0 : 2);
-                break;
-            }
+            case OP_ANNN:
+                if (b == OP_DXYN)
+                {
+                    head->kind = OP_FUSED_ANNN_DXYN;
+                }
 
-            case 0xA000: // 0xANNN : Sets I to the address NNN.
-                sys->I = sys->op & 0x0FFF;
                 break;
 
-            case 0xB000: // 0xBNNN : Jumps to the address NNN plus V0.
-                sys->pc = (sys->op & 0x0FFF) + sys->V0;
-                break;
+            case OP_7XNN:
+                if (b == OP_3XNN && plainKind(*decodedAt(sys, index + 2)) == OP_1NNN)
+                {
+                    head->kind = OP_FUSED_7XNN_3XNN_1NNN;
+                }
 
-            case 0xC000: // 0xCXNN : Sets VX to the result of a bitwise and operation on a random number (Typically: 0 to 255) and NN.
-            {
-                const uint8_t reg = (sys->op & 0x0F00) >> 8;
-                const uint8_t val = (sys->op & 0x00FF);
-                sys->V[reg] = uint8_t(rand() & val);
                 break;
-            }
 
-            case 0xD000: // 0xDXYN: Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels.
-            {
-                const uint8_t x = sys->V[(sys->op & 0x0F00) >> 8];
-                const uint8_t y = sys->V[(sys->op & 0x00F0) >> 4];
-                const uint8_t h = sys->op & 0x000F;
-
-                sys->VF = 0;
-
-                if (x <= 56)
+            case OP_FX07:
+                if (b == OP_3XNN && plainKind(*decodedAt(sys, index + 2)) == OP_1NNN)
                 {
-                    // No horizontal overdraw.
+                    head->kind = OP_FUSED_FX07_3XNN_1NNN;
+                }
 
-                    for (uint8_t n = 0; n < h; ++n)
-                    {
-                        const uint8_t row = (y + n) % arrSize(sys->fb);
-                        const uint8_t px  = sys->mem[sys->I + n];
+                break;
+        }
+    }
 
-                        drawHorizLine(sys, x, row, 8, px);
-                    }
-                }
-                else
-                {
-                    // Horizontal overdraw.
+    static uint16_t readOp(const System* sys, uint16_t addr)
+    {
+        return (sys->mem[addr] << 8) | sys->mem[addr + 1];
+    }
 
-                    const uint8_t w1 = 64 - x;
-                    const uint8_t w2 = 8 - w1;
+    static const Instr* fetchInstr(System* sys, Instr* scratch)
+    {
+        const uint16_t pc = sys->pc;
+        sys->pc += 2;
+        ++sys->cycles;
 
-                    for (uint8_t n = 0; n < h; ++n)
-                    {
-                        const uint8_t row = (y + n) % arrSize(sys->fb);
-                        const uint8_t px  = sys->mem[sys->I + n];
-                        const uint8_t p1  = px >> w2;
-                        const uint8_t p2  = px & ((1 << w2) - 1);
+        Instr* instr = scratch;
 
-                        drawHorizLine(sys, x, row, w1, p1);
-                        drawHorizLine(sys, 0, row, w2, p2);
-                    }
-                }
+        if (pc > sizeof(sys->mem) - 2)
+        {
+            // Ran off the end of memory, which faults as an unknown
+            // instruction would rather than reading past it.
+            *instr      = Instr{};
+            instr->kind = OP_UNKNOWN;
+            sys->op     = 0;
+            return instr;
+        }
 
-                o_opts->fbUpdated = true;
+        if (!(pc & 1))
+        {
+            instr = &sys->decoded[pc / 2];
 
-                break;
+            if (instr->kind != OP_NONE)
+            {
+                sys->op = instr->op;
+                return instr;
             }
+        }
 
-            case 0xE000:
-            {
-                const uint8_t reg = (sys->op & 0x0F00) >> 8;
+        // Not in the cache, or at an odd address. The latter is legal but
+        // rare enough to not be worth caching.
+        const uint16_t hi = sys->mem[pc + 0];
+        const uint16_t lo = sys->mem[pc + 1];
+        sys->op = (hi << 8) | lo;
 
-                switch (sys->op & 0x00FF)
-                {
-                    case 0x009E: // 0xEX9E : Skips the next instruction if the key stored in VX is pressed.
-                    {
-                        const uint8_t  key  = sys->V[reg];
-                        const uint16_t mask = 1 << key;
-                        sys->pc += (sys->keys & mask ? 2 : 0);
-                        break;
-                    }
+        decodeOpCode(sys->op, instr);
 
-                    case 0x00A1: // 0xEXA1 : Skips the next instruction if the key stored in VX isn't pressed.
-                    {
-                        const uint8_t  key  = sys->V[reg];
-                        const uint16_t mask = 1 << key;
-                        sys->pc += (sys->keys & mask ? 0 : 2);
-                        break;
-                    }
+        if (instr != scratch && sys->engine == ENGINE_FUSED)
+        {
+            fuseInstr(sys, pc / 2);
+        }
 
-                    default:
-                        goto unknown_op;
-                }
+        return instr;
+    }
 
-                break;
-            }
+    static constexpr uint32_t TIMER_HZ = 60;
 
-            case 0xF000:
-            {
-                const uint8_t reg = (sys->op & 0x0F00) >> 8;
+    static uint64_t currentTick(const System* sys)
+    {
+        return sys->cycles * TIMER_HZ / sys->cycleHz;
+    }
 
-                switch (sys->op & 0x00FF)
-                {
-                    case 0x0007: // 0xFX07 : Sets VX to the value of the delay timer.
-                        sys->V[reg] = sys->delayTimer;
-                        break;
+    static uint8_t timerValue(const System* sys, uint64_t end)
+    {
+        const uint64_t tick = currentTick(sys);
+        return uint8_t(end > tick ? end - tick : 0);
+    }
 
-                    case 0x000A: // 0xFX0A : A key press is awaited, and then stored in VX. (Blocking Operation.)
-                        fprintf(stderr, "FIXME: Implement 0xFX0A\n");
-                        break;
+    // 0x00E0 : Clears the screen.
+    static void op00E0(System* sys, const Instr&, CycleOpts* o_opts)
+    {
+        for (uint32_t y = 0; y < arrSize(sys->fb); ++y)
+        {
+            sys->fbDirty |= uint32_t(sys->fb[y] != 0) << y;
+            sys->fb[y]    = 0;
+        }
 
-                    case 0x0015: // 0xFX15 : Sets the delay timer to VX.
-                        sys->delayTimer = sys->V[reg];
-                        break;
+        o_opts->exit = RUN_FB_UPDATED;
+    }
 
-                    case 0x0018: // 0xFX18 : Sets the sound timer to VX.
-                        sys->soundTimer = sys->V[reg];
-                        break;
+    // 0x00EE : Returns from a subroutine.
+    static void op00EE(System* sys, const Instr&, CycleOpts* o_opts)
+    {
+        if (sys->sp <= 0)
+        {
+            sys->pc     -= 2;
+            o_opts->exit = RUN_STACK_FAULT;
+            return;
+        }
 
-                    case 0x001E: // 0xFX1E : Adds VX to I.
-                        sys->I += sys->V[reg];
-                        break;
+        sys->pc = sys->stack[--(sys->sp)];
+    }
 
-                    case 0x0029: // 0xFX29 : Sets I to the location of the sprite for the character in VX.
-                        sys->I = sys->V[reg] * 5;
-                        break;
+    // 0x0NNN : Jump to a machine code routine at nnn. (ignored)
+    static void op0NNN(System*, const Instr&, CycleOpts*)
+    {
+    }
 
-                    case 0x0033: // 0xFX33 : Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, and the least significant digit at I plus 2.
-                        sys->mem[sys->I + 0] = sys->V[reg] / 100;
-                        sys->mem[sys->I + 1] = (sys->V[reg] / 10) % 10;
-                        sys->mem[sys->I + 2] = sys->V[reg] % 10;
-                        break;
+    // 0x1NNN : Jumps to address NNN.
+    static void op1NNN(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->pc = instr.nnn;
+    }
 
-                    case 0x0055: // 0xFX55 : Stores V0 to VX (including VX) in memory starting at address I.
-                        memcpy(sys->mem + sys->I, sys->V, reg + 1);
-                        break;
+    // 0x2NNN : Calls subroutine at NNN.
+    static void op2NNN(System* sys, const Instr& instr, CycleOpts* o_opts)
+    {
+        if (sys->sp >= int8_t(arrSize(sys->stack)))
+        {
+            sys->pc     -= 2;
+            o_opts->exit = RUN_STACK_FAULT;
+            return;
+        }
 
-                    case 0x0065: // 0xFX65 : Fills V0 to VX (including VX) with values from memory starting at address I.
-                        memcpy(sys->V, sys->mem + sys->I, reg + 1);
-                        break;
+        sys->stack[(sys->sp)++] = sys->pc;
+        sys->pc = instr.nnn;
+    }
 
-                    default:
-                        goto unknown_op;
-                }
+    // 0x3XNN : Skips the next instruction if VX equals NN.
+    static void op3XNN(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->pc += (sys->V[instr.x] == instr.nn ? 2 : 0);
+    }
 
-                break;
-            }
+    // 0x4XNN : Skips the next instruction if VX doesn't equal NN.
+    static void op4XNN(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->pc += (sys->V[instr.x] == instr.nn ? 0 : 2);
+    }
 
-            default:
-                goto unknown_op;
-        }
+    // 0x5XY0 : Skips the next instruction if VX equals VY.
+    static void op5XY0(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->pc += (sys->V[instr.x] == sys->V[instr.y] ? 2 : 0);
+    }
 
-        return;
+    // 0x6XNN : Sets VX to NN.
+    static void op6XNN(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->V[instr.x] = instr.nn;
+    }
 
-    unknown_op:
-        printf("unknown op code: 0x%4X\n", sys->op);
-        assert(!"unknown op code");
+    // 0x7XNN : Adds NN to VX. (Carry flag is not changed)
+    static void op7XNN(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->V[instr.x] += instr.nn;
     }
 
-    static constexpr int64_t NS_PER_SEC           = 1000000000;
-    static constexpr int64_t TIMER_UPDATE_NS_FREQ = NS_PER_SEC / 60;
+    // 0x8XY0 : Sets VX to the value of VY.
+    static void op8XY0(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->V[instr.x] = sys->V[instr.y];
+    }
 
-    static void timeAdd(struct timespec* ts, int64_t nsec)
+    // 0x8XY1 : Sets VX to VX or VY. (Bitwise OR operation)
+    template<uint32_t Q>
+    static void op8XY1(System* sys, const Instr& instr, CycleOpts*)
     {
-        ts->tv_sec  += (nsec / NS_PER_SEC);
-        ts->tv_nsec += (nsec % NS_PER_SEC);
+        sys->V[instr.x] |= sys->V[instr.y];
 
-        if (ts->tv_nsec > NS_PER_SEC)
+        if (Q & QUIRK_VF_RESET)
         {
-            ts->tv_sec  += 1;
-            ts->tv_nsec -= NS_PER_SEC;
+            sys->VF = 0;
         }
     }
 
-    static int32_t timeCmp(struct timespec* a, struct timespec* b)
+    // 0x8XY2 : Sets VX to VX and VY. (Bitwise AND operation)
+    template<uint32_t Q>
+    static void op8XY2(System* sys, const Instr& instr, CycleOpts*)
     {
-        if (a->tv_sec == b->tv_sec)
+        sys->V[instr.x] &= sys->V[instr.y];
+
+        if (Q & QUIRK_VF_RESET)
         {
-            if (a->tv_nsec < b->tv_nsec)
-            {
-                return -1;
-            }
+            sys->VF = 0;
+        }
+    }
 
-            if (b->tv_nsec < a->tv_nsec)
-            {
-                return 1;
-            }
+    // 0x8XY3 : Sets VX to VX xor VY.
+    template<uint32_t Q>
+    static void op8XY3(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->V[instr.x] ^= sys->V[instr.y];
 
-            return 0;
+        if (Q & QUIRK_VF_RESET)
+        {
+            sys->VF = 0;
         }
+    }
 
-        return (a->tv_sec < b->tv_sec) ? -1 : 1;
+    // 0x8XY4 : Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+    static void op8XY4(System* sys, const Instr& instr, CycleOpts*)
+    {
+        const uint16_t res = sys->V[instr.x] + sys->V[instr.y];
+        sys->V[instr.x] = uint8_t(res);
+        sys->VF         = (res >> 8 ? 1 : 0);
     }
 
-    void systemInit(System* sys)
+    // 0x8XY5 : VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+    static void op8XY5(System* sys, const Instr& instr, CycleOpts*)
     {
-        memset(sys, 0, sizeof(*sys));
-        memcpy(sys->mem, CHIP8_FONT, sizeof(CHIP8_FONT));
-        sys->pc = 0x200;
-        clock_gettime(CLOCK_MONOTONIC, &sys->nextTick);
-        timeAdd(&sys->nextTick, TIMER_UPDATE_NS_FREQ);
+        const uint16_t res = sys->V[instr.x] - sys->V[instr.y];
+        sys->V[instr.x] = uint8_t(res);
+        sys->VF         = (res >> 8 ? 0 : 1);
     }
 
-    void systemProgramMem(System* sys, void** o_buf, uint16_t* o_maxSize)
+    // 0x8XY6 : Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
+    template<uint32_t Q>
+    static void op8XY6(System* sys, const Instr& instr, CycleOpts*)
     {
-        *o_buf     = sys->mem + 0x200;
-        *o_maxSize = sizeof(sys->mem) - 0x200;
+        if (Q & QUIRK_SHIFT_VY)
+        {
+            const uint8_t vy = sys->V[instr.y];
+            sys->V[instr.x]  = vy >> 1;
+            sys->VF          = (vy & 1);
+        }
+        else
+        {
+            sys->VF           = (sys->V[instr.x] & 1);
+            sys->V[instr.x] >>= 1;
+        }
     }
 
-    void systemCycle(System* sys, CycleOpts* o_opts)
+    // 0x8XY7 : Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+    static void op8XY7(System* sys, const Instr& instr, CycleOpts*)
+    {
+        const uint16_t res = sys->V[instr.y] - sys->V[instr.x];
+        sys->V[instr.x] = uint8_t(res);
+        sys->VF         = (res >> 8 ? 0 : 1);
+    }
+
+    // 0x8XYE : Stores the most significant bit of VX in VF and then shifts VX to the left by 1.
+    template<uint32_t Q>
+    static void op8XYE(System* sys, const Instr& instr, CycleOpts*)
+    {
+        if (Q & QUIRK_SHIFT_VY)
+        {
+            const uint8_t vy = sys->V[instr.y];
+            sys->V[instr.x]  = uint8_t(vy << 1);
+            sys->VF          = (vy & 0x80) >> 7;
+        }
+        else
+        {
+            sys->VF           = (sys->V[instr.x] & 0x80) >> 7;
+            sys->V[instr.x] <<= 1;
+        }
+    }
+
+    // 0x9XY0 : Skips the next instruction if VX doesn't equal VY.
+    static void op9XY0(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->pc += (instr.x == instr.y ? 0 : 2);
+    }
+
+    // 0xANNN : Sets I to the address NNN.
+    static void opANNN(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->I = instr.nnn;
+    }
+
+    // 0xBNNN : Jumps to the address NNN plus V0.
+    template<uint32_t Q>
+    static void opBNNN(System* sys, const Instr& instr, CycleOpts*)
     {
-        fetchOpCode(sys);
-        execOpCode(sys, o_opts);
+        sys->pc = instr.nnn + (Q & QUIRK_JUMP_VX ? sys->V[instr.x] : sys->V0);
+    }
 
-        struct timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
+    // 0xCXNN : Sets VX to the result of a bitwise and operation on a random number (Typically: 0 to 255) and NN.
+    static void opCXNN(System* sys, const Instr& instr, CycleOpts*)
+    {
+        // Xorshift, so the sequence is part of the system's state.
+        uint32_t x = sys->rng;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        sys->rng = x;
+
+        sys->V[instr.x] = uint8_t((x >> 24) & instr.nn);
+    }
 
-        while (timeCmp(&sys->nextTick, &now) < 0)
+    // 0xDXYN: Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels.
+    template<uint32_t Q>
+    static void opDXYN(System* sys, const Instr& instr, CycleOpts* o_opts)
+    {
+        if (Q & QUIRK_DISPLAY_WAIT)
         {
-            if (sys->delayTimer > 0)
+            // The VIP only drew in time with the display, so at most one
+            // sprite per frame. Retry until the next tick, as it would wait.
+            const uint64_t tick = currentTick(sys);
+
+            if (tick < sys->drawTick)
             {
-                --sys->delayTimer;
+                sys->pc -= 2;
+                return;
             }
 
-            if (sys->soundTimer > 0)
+            sys->drawTick = tick + 1;
+        }
+
+        // The starting position always wraps, only the sprite itself may be
+        // clipped.
+        const uint8_t x = sys->V[instr.x] % 64;
+        const uint8_t y = sys->V[instr.y] % arrSize(sys->fb);
+        const uint8_t h = instr.nn & 0x0F;
+
+        sys->VF = 0;
+
+        if (Q & QUIRK_CLIP_SPRITES)
+        {
+            const uint8_t w = (x <= 56 ? 8 : 64 - x);
+
+            for (uint8_t n = 0; n < h && y + n < arrSize(sys->fb); ++n)
             {
-                if (--sys->soundTimer == 0)
-                {
-                    putc('\a', stdout);
-                    fflush(stdout);
-                }
+                const uint8_t px = sys->mem[wrapAddr(sys->I + n)];
+                drawHorizLine(sys, x, y + n, w, px >> (8 - w));
             }
-
-            timeAdd(&sys->nextTick, TIMER_UPDATE_NS_FREQ);
         }
+        else if (x <= 56)
+        {
+            // No horizontal overdraw.
+
+            for (uint8_t n = 0; n < h; ++n)
+            {
+                const uint8_t row = (y + n) % arrSize(sys->fb);
+                const uint8_t px  = sys->mem[wrapAddr(sys->I + n)];
+
+                drawHorizLine(sys, x, row, 8, px);
+            }
+        }
+        else
+        {
+            // Horizontal overdraw.
+
+            const uint8_t w1 = 64 - x;
+            const uint8_t w2 = 8 - w1;
+
+            for (uint8_t n = 0; n < h; ++n)
+            {
+                const uint8_t row = (y + n) % arrSize(sys->fb);
+                const uint8_t px  = sys->mem[wrapAddr(sys->I + n)];
+                const uint8_t p1  = px >> w2;
+                const uint8_t p2  = px & ((1 << w2) - 1);
+
+                drawHorizLine(sys, x, row, w1, p1);
+                drawHorizLine(sys, 0, row, w2, p2);
+            }
+        }
+
+        o_opts->exit = RUN_FB_UPDATED;
+    }
+
+    // 0xEX9E : Skips the next instruction if the key stored in VX is pressed.
+    static void opEX9E(System* sys, const Instr& instr, CycleOpts*)
+    {
+        const uint8_t  key  = sys->V[instr.x];
+        const uint16_t mask = 1 << key;
+        sys->pc += (sys->keys & mask ? 2 : 0);
+    }
+
+    // 0xEXA1 : Skips the next instruction if the key stored in VX isn't pressed.
+    static void opEXA1(System* sys, const Instr& instr, CycleOpts*)
+    {
+        const uint8_t  key  = sys->V[instr.x];
+        const uint16_t mask = 1 << key;
+        sys->pc += (sys->keys & mask ? 0 : 2);
+    }
+
+    // 0xFX07 : Sets VX to the value of the delay timer.
+    static void opFX07(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->V[instr.x] = timerValue(sys, sys->delayEnd);
+    }
+
+    // 0xFX0A : A key press is awaited, and then stored in VX. (Blocking Operation.)
+    static void opFX0A(System* sys, const Instr& instr, CycleOpts* o_opts)
+    {
+        if (!sys->keys)
+        {
+            // Stay on this instruction until there is a key.
+            sys->pc     -= 2;
+            o_opts->exit = RUN_WAIT_KEY;
+            return;
+        }
+
+        uint8_t key = 0;
+
+        while (!(sys->keys & (1 << key)))
+        {
+            ++key;
+        }
+
+        sys->V[instr.x] = key;
+    }
+
+    // 0xFX15 : Sets the delay timer to VX.
+    static void opFX15(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->delayEnd = currentTick(sys) + sys->V[instr.x];
+    }
+
+    // 0xFX18 : Sets the sound timer to VX.
+    static void opFX18(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->soundEnd = (sys->V[instr.x] ? currentTick(sys) + sys->V[instr.x] : 0);
+    }
+
+    // 0xFX1E : Adds VX to I.
+    static void opFX1E(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->I += sys->V[instr.x];
+    }
+
+    // 0xFX29 : Sets I to the location of the sprite for the character in VX.
+    static void opFX29(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->I = sys->V[instr.x] * 5;
+    }
+
+    // 0xFX33 : Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, and the least significant digit at I plus 2.
+    static void opFX33(System* sys, const Instr& instr, CycleOpts*)
+    {
+        sys->mem[wrapAddr(sys->I + 0)] = sys->V[instr.x] / 100;
+        sys->mem[wrapAddr(sys->I + 1)] = (sys->V[instr.x] / 10) % 10;
+        sys->mem[wrapAddr(sys->I + 2)] = sys->V[instr.x] % 10;
+        invalidateWrapped(sys, sys->I, 3);
+    }
+
+    // 0xFX55 : Stores V0 to VX (including VX) in memory starting at address I.
+    template<uint32_t Q>
+    static void opFX55(System* sys, const Instr& instr, CycleOpts*)
+    {
+        for (uint8_t i = 0; i <= instr.x; ++i)
+        {
+            sys->mem[wrapAddr(sys->I + i)] = sys->V[i];
+        }
+
+        invalidateWrapped(sys, sys->I, instr.x + 1);
+
+        if (Q & QUIRK_INC_I)
+        {
+            sys->I += instr.x + 1;
+        }
+    }
+
+    // 0xFX65 : Fills V0 to VX (including VX) with values from memory starting at address I.
+    template<uint32_t Q>
+    static void opFX65(System* sys, const Instr& instr, CycleOpts*)
+    {
+        for (uint8_t i = 0; i <= instr.x; ++i)
+        {
+            sys->V[i] = sys->mem[wrapAddr(sys->I + i)];
+        }
+
+        if (Q & QUIRK_INC_I)
+        {
+            sys->I += instr.x + 1;
+        }
+    }
+
+    static void opUnknown(System* sys, const Instr&, CycleOpts* o_opts)
+    {
+        sys->pc     -= 2;
+        o_opts->exit = RUN_UNKNOWN_OP;
+    }
+
+    template<uint32_t Q>
+    static void execOpCode(System* sys, const Instr& instr, CycleOpts* o_opts)
+    {
+        switch (instr.kind)
+        {
+            case OP_00E0: op00E0(sys, instr, o_opts); break;
+            case OP_00EE: op00EE(sys, instr, o_opts); break;
+            case OP_0NNN: op0NNN(sys, instr, o_opts); break;
+            case OP_1NNN: op1NNN(sys, instr, o_opts); break;
+            case OP_2NNN: op2NNN(sys, instr, o_opts); break;
+            case OP_3XNN: op3XNN(sys, instr, o_opts); break;
+            case OP_4XNN: op4XNN(sys, instr, o_opts); break;
+            case OP_5XY0: op5XY0(sys, instr, o_opts); break;
+            case OP_6XNN: op6XNN(sys, instr, o_opts); break;
+            case OP_7XNN: op7XNN(sys, instr, o_opts); break;
+            case OP_8XY0: op8XY0(sys, instr, o_opts); break;
+            case OP_8XY1: op8XY1<Q>(sys, instr, o_opts); break;
+            case OP_8XY2: op8XY2<Q>(sys, instr, o_opts); break;
+            case OP_8XY3: op8XY3<Q>(sys, instr, o_opts); break;
+            case OP_8XY4: op8XY4(sys, instr, o_opts); break;
+            case OP_8XY5: op8XY5(sys, instr, o_opts); break;
+            case OP_8XY6: op8XY6<Q>(sys, instr, o_opts); break;
+            case OP_8XY7: op8XY7(sys, instr, o_opts); break;
+            case OP_8XYE: op8XYE<Q>(sys, instr, o_opts); break;
+            case OP_9XY0: op9XY0(sys, instr, o_opts); break;
+            case OP_ANNN: opANNN(sys, instr, o_opts); break;
+            case OP_BNNN: opBNNN<Q>(sys, instr, o_opts); break;
+            case OP_CXNN: opCXNN(sys, instr, o_opts); break;
+            case OP_DXYN: opDXYN<Q>(sys, instr, o_opts); break;
+            case OP_EX9E: opEX9E(sys, instr, o_opts); break;
+            case OP_EXA1: opEXA1(sys, instr, o_opts); break;
+            case OP_FX07: opFX07(sys, instr, o_opts); break;
+            case OP_FX0A: opFX0A(sys, instr, o_opts); break;
+            case OP_FX15: opFX15(sys, instr, o_opts); break;
+            case OP_FX18: opFX18(sys, instr, o_opts); break;
+            case OP_FX1E: opFX1E(sys, instr, o_opts); break;
+            case OP_FX29: opFX29(sys, instr, o_opts); break;
+            case OP_FX33: opFX33(sys, instr, o_opts); break;
+            case OP_FX55: opFX55<Q>(sys, instr, o_opts); break;
+            case OP_FX65: opFX65<Q>(sys, instr, o_opts); break;
+
+            default:
+                opUnknown(sys, instr, o_opts);
+                break;
+        }
+    }
+
+    // Executes the fused group headed by `head`, whose pc has already been
+    // fetched. Returns the number of instructions executed.
+    template<uint32_t Q>
+    static uint32_t execFused(System* sys, const Instr& head, CycleOpts* o_opts)
+    {
+        const uint32_t index = (sys->pc - 2) / 2;
+        const Instr&   b     = sys->decoded[index + 1];
+        const Instr&   c     = sys->decoded[index + 2];
+
+        switch (head.kind)
+        {
+            case OP_FUSED_6XNN_6XNN_DXYN:
+                sys->pc     += 4;
+                sys->cycles += 2;
+                sys->op      = c.op;
+                op6XNN(sys, head, o_opts);
+                op6XNN(sys, b, o_opts);
+                opDXYN<Q>(sys, c, o_opts);
+                return 3;
+
+            case OP_FUSED_ANNN_DXYN:
+                sys->pc     += 2;
+                sys->cycles += 1;
+                sys->op      = b.op;
+                opANNN(sys, head, o_opts);
+                opDXYN<Q>(sys, b, o_opts);
+                return 2;
+
+            case OP_FUSED_7XNN_3XNN_1NNN:
+            case OP_FUSED_FX07_3XNN_1NNN:
+                if (head.kind == OP_FUSED_7XNN_3XNN_1NNN)
+                {
+                    op7XNN(sys, head, o_opts);
+                }
+                else
+                {
+                    opFX07(sys, head, o_opts);
+                }
+
+                if (sys->V[b.x] == b.nn)
+                {
+                    // The jump is skipped.
+                    sys->pc     += 4;
+                    sys->cycles += 1;
+                    sys->op      = b.op;
+                    return 2;
+                }
+
+                sys->pc      = c.nnn;
+                sys->cycles += 2;
+                sys->op      = c.op;
+                return 3;
+
+            default:
+                opUnknown(sys, head, o_opts);
+                return 1;
+        }
+    }
+
+    template<uint32_t Q>
+    static uint32_t runSwitch(System* sys, CycleOpts* o_opts, uint32_t maxOps)
+    {
+        uint32_t numOps = 0;
+
+        while (numOps < maxOps && o_opts->exit == RUN_BUDGET)
+        {
+            Instr scratch;
+            const Instr* instr = fetchInstr(sys, &scratch);
+            execOpCode<Q>(sys, *instr, o_opts);
+            ++numOps;
+        }
+
+        return numOps;
+    }
+
+#if defined(__GNUC__)
+
+    // Direct-threaded variant of `runSwitch`. Every handler ends in its own
+    // indirect jump to the next one, rather than all of them sharing the one
+    // jump at the top of the switch, which gives the branch predictor a lot
+    // more to work with in tight loops.
+    template<uint32_t Q>
+    static uint32_t runThreaded(System* sys, CycleOpts* o_opts, uint32_t maxOps)
+    {
+        static void* const s_labels[] =
+        {
+            &&l_Unknown, // OP_NONE is never returned by fetchInstr.
+            &&l_00E0, &&l_00EE, &&l_0NNN, &&l_1NNN, &&l_2NNN, &&l_3XNN,
+            &&l_4XNN, &&l_5XY0, &&l_6XNN, &&l_7XNN, &&l_8XY0, &&l_8XY1,
+            &&l_8XY2, &&l_8XY3, &&l_8XY4, &&l_8XY5, &&l_8XY6, &&l_8XY7,
+            &&l_8XYE, &&l_9XY0, &&l_ANNN, &&l_BNNN, &&l_CXNN, &&l_DXYN,
+            &&l_EX9E, &&l_EXA1, &&l_FX07, &&l_FX0A, &&l_FX15, &&l_FX18,
+            &&l_FX1E, &&l_FX29, &&l_FX33, &&l_FX55, &&l_FX65, &&l_Unknown,
+        };
+
+        static_assert(arrSize(s_labels) == OP_COUNT, "missing label for op kind");
+
+        uint32_t     numOps = 0;
+        Instr        scratch;
+        const Instr* instr;
+
+#define DISPATCH()                                      \
+        if (numOps == maxOps || o_opts->exit)           \
+        {                                               \
+            return numOps;                              \
+        }                                               \
+                                                        \
+        instr = fetchInstr(sys, &scratch);              \
+        ++numOps;                                       \
+        goto *s_labels[instr->kind]
+
+#define HANDLER(name)                                   \
+    l_##name:                                           \
+        op##name(sys, *instr, o_opts);                  \
+        DISPATCH()
+
+#define QUIRK_HANDLER(name)                             \
+    l_##name:                                           \
+        op##name<Q>(sys, *instr, o_opts);               \
+        DISPATCH()
+
+        DISPATCH();
+
+        HANDLER(00E0);
+        HANDLER(00EE);
+        HANDLER(0NNN);
+        HANDLER(1NNN);
+        HANDLER(2NNN);
+        HANDLER(3XNN);
+        HANDLER(4XNN);
+        HANDLER(5XY0);
+        HANDLER(6XNN);
+        HANDLER(7XNN);
+        HANDLER(8XY0);
+        QUIRK_HANDLER(8XY1);
+        QUIRK_HANDLER(8XY2);
+        QUIRK_HANDLER(8XY3);
+        HANDLER(8XY4);
+        HANDLER(8XY5);
+        QUIRK_HANDLER(8XY6);
+        HANDLER(8XY7);
+        QUIRK_HANDLER(8XYE);
+        HANDLER(9XY0);
+        HANDLER(ANNN);
+        QUIRK_HANDLER(BNNN);
+        HANDLER(CXNN);
+        QUIRK_HANDLER(DXYN);
+        HANDLER(EX9E);
+        HANDLER(EXA1);
+        HANDLER(FX07);
+        HANDLER(FX0A);
+        HANDLER(FX15);
+        HANDLER(FX18);
+        HANDLER(FX1E);
+        HANDLER(FX29);
+        HANDLER(FX33);
+        QUIRK_HANDLER(FX55);
+        QUIRK_HANDLER(FX65);
+        HANDLER(Unknown);
+
+#undef QUIRK_HANDLER
+#undef HANDLER
+#undef DISPATCH
+    }
+
+#endif // defined(__GNUC__)
+
+    // Runs translated blocks where there are any, and interprets the rest.
+    // Blocks stop early if the budget runs out partway through them.
+    static uint32_t runJit(System* sys, CycleOpts* o_opts, uint32_t maxOps)
+    {
+        uint32_t numOps = 0;
+
+        while (numOps < maxOps && o_opts->exit == RUN_BUDGET)
+        {
+            const JitBlock* block = jitLookup(sys->jit, sys, sys->pc);
+
+            if (block)
+            {
+                const uint32_t ran = block->fn(sys, maxOps - numOps);
+
+                // Blocks don't write to memory, so the last instruction is
+                // still right before where one that stopped early left the pc.
+                sys->op      = (ran == block->numOps ? block->lastOp : readOp(sys, sys->pc - 2));
+                sys->cycles += ran;
+                numOps      += ran;
+            }
+            else
+            {
+                Instr scratch;
+                const Instr* instr = fetchInstr(sys, &scratch);
+                execOpCode<0>(sys, *instr, o_opts);
+                ++numOps;
+            }
+        }
+
+        return numOps;
+    }
+
+    static uint32_t runAot(System* sys, CycleOpts* o_opts, uint32_t maxOps)
+    {
+        uint32_t numOps = 0;
+
+        while (numOps < maxOps && o_opts->exit == RUN_BUDGET)
+        {
+            const uint32_t ran = (sys->aot && !sys->numAotStale ? sys->aot->run(sys, o_opts, maxOps - numOps) : 0);
+
+            if (ran)
+            {
+                numOps += ran;
+            }
+            else
+            {
+                Instr scratch;
+                const Instr* instr = fetchInstr(sys, &scratch);
+                execOpCode<0>(sys, *instr, o_opts);
+                ++numOps;
+            }
+        }
+
+        return numOps;
+    }
+
+    // Like `runSwitch`, but executes fused groups as one when there is budget
+    // left for all of their instructions.
+    template<uint32_t Q>
+    static uint32_t runFused(System* sys, CycleOpts* o_opts, uint32_t maxOps)
+    {
+        uint32_t numOps = 0;
+
+        while (numOps < maxOps && o_opts->exit == RUN_BUDGET)
+        {
+            Instr scratch;
+            const Instr* instr = fetchInstr(sys, &scratch);
+
+            if (instr->kind < OP_COUNT)
+            {
+                execOpCode<Q>(sys, *instr, o_opts);
+                ++numOps;
+            }
+            else if (maxOps - numOps >= MAX_FUSED_OPS)
+            {
+                numOps += execFused<Q>(sys, *instr, o_opts);
+                ++sys->numFused;
+            }
+            else
+            {
+                Instr plain = *instr;
+                plain.kind  = decodeKind(plain.op);
+                execOpCode<Q>(sys, plain, o_opts);
+                ++numOps;
+            }
+        }
+
+        return numOps;
+    }
+
+    // ENGINE_TABLE maps every one of the 65536 opcodes straight to a handler,
+    // through tables built at compile time. Handlers are instantiated per op
+    // kind and, for the kinds that take them, per X and Y, so that register
+    // indices are constants rather than something decoded at run time. Kinds
+    // that don't take registers, or where they'd gain little (DXYN), decode
+    // what they need from the opcode. Only the default quirks are supported,
+    // as the tables are too big to instantiate for every profile.
+
+    using TableHandler = void (*)(System* sys, uint16_t op, CycleOpts* o_opts);
+    using OpHandler    = void (*)(System* sys, const Instr& instr, CycleOpts* o_opts);
+
+    // Indexed by op kind.
+    static constexpr OpHandler OP_HANDLERS[] =
+    {
+        opUnknown, op00E0, op00EE, op0NNN, op1NNN, op2NNN, op3XNN, op4XNN,
+        op5XY0, op6XNN, op7XNN, op8XY0, op8XY1<0>, op8XY2<0>, op8XY3<0>, op8XY4,
+        op8XY5, op8XY6<0>, op8XY7, op8XYE<0>, op9XY0, opANNN, opBNNN<0>, opCXNN,
+        opDXYN<0>, opEX9E, opEXA1, opFX07, opFX0A, opFX15, opFX18, opFX1E,
+        opFX29, opFX33, opFX55<0>, opFX65<0>, opUnknown,
+    };
+
+    static_assert(arrSize(OP_HANDLERS) == OP_COUNT, "missing handler for op kind");
+
+    // Which register indices a kind's handlers are specialized on.
+    enum OpRegs : uint8_t
+    {
+        REGS_NONE,
+        REGS_X,
+        REGS_XY,
+    };
+
+    static constexpr uint8_t opRegs(uint8_t kind)
+    {
+        return ((kind == OP_5XY0 || (kind >= OP_8XY0 && kind <= OP_9XY0)) ? REGS_XY :
+                (kind == OP_3XNN || kind == OP_4XNN || kind == OP_6XNN || kind == OP_7XNN || kind == OP_CXNN ||
+                 (kind >= OP_EX9E && kind <= OP_FX65)) ? REGS_X :
+                REGS_NONE);
+    }
+
+    static constexpr uint32_t numVariants(uint8_t kind)
+    {
+        return (opRegs(kind) == REGS_XY ? 256 : opRegs(kind) == REGS_X ? 16 : 1);
+    }
+
+    static constexpr uint32_t sumVariants(uint8_t kind)
+    {
+        return (kind == 0 ? 0 : sumVariants(kind - 1) + numVariants(kind - 1));
+    }
+
+    static_assert(sumVariants(OP_COUNT) <= 0x10000, "handler indices must fit in 16 bits");
+
+    template<class Seq>
+    struct KindTable;
+
+    template<uint32_t... Kinds>
+    struct KindTable<IndexSeq<Kinds...>>
+    {
+        // Index of the first handler of every kind in the handler table, and
+        // the total number of handlers at the end.
+        static constexpr uint16_t first[] = { uint16_t(sumVariants(Kinds))... };
+    };
+
+    template<uint32_t... Kinds>
+    constexpr uint16_t KindTable<IndexSeq<Kinds...>>::first[];
+
+    using KindHandlers = KindTable<MakeSeq<OP_COUNT + 1>::Type>;
+
+    static constexpr uint32_t firstHandler(uint8_t kind)
+    {
+        return KindHandlers::first[kind];
+    }
+
+    static constexpr uint32_t NUM_TABLE_HANDLERS = firstHandler(OP_COUNT);
+
+    static constexpr uint32_t handlerVariant(uint8_t kind, uint16_t op)
+    {
+        return (opRegs(kind) == REGS_XY ? (op & 0x0FF0) >> 4 :
+                opRegs(kind) == REGS_X  ? (op & 0x0F00) >> 8 :
+                                          0);
+    }
+
+    static constexpr uint16_t handlerIndex(uint16_t op)
+    {
+        return uint16_t(firstHandler(decodeKind(op)) + handlerVariant(decodeKind(op), op));
+    }
+
+    static constexpr uint8_t handlerKind(uint32_t index, uint8_t kind = 0)
+    {
+        return (firstHandler(kind + 1) > index ? kind : handlerKind(index, kind + 1));
+    }
+
+    static constexpr uint8_t handlerX(uint32_t index)
+    {
+        return (opRegs(handlerKind(index)) == REGS_XY ? ((index - firstHandler(handlerKind(index))) >> 4) :
+                opRegs(handlerKind(index)) == REGS_X  ? (index - firstHandler(handlerKind(index))) :
+                                                        0);
+    }
+
+    static constexpr uint8_t handlerY(uint32_t index)
+    {
+        return (opRegs(handlerKind(index)) == REGS_XY ? ((index - firstHandler(handlerKind(index))) & 0x0F) : 0);
+    }
+
+    template<uint8_t KIND, uint8_t X, uint8_t Y>
+    static void tableOp(System* sys, uint16_t op, CycleOpts* o_opts)
+    {
+        constexpr uint8_t regs = opRegs(KIND);
+
+        Instr instr;
+        instr.op   = op;
+        instr.nnn  = (op & 0x0FFF);
+        instr.kind = KIND;
+        instr.x    = (regs == REGS_NONE ? (op & 0x0F00) >> 8 : X);
+        instr.y    = (regs != REGS_XY ? (op & 0x00F0) >> 4 : Y);
+        instr.nn   = (op & 0x00FF);
+
+        OP_HANDLERS[KIND](sys, instr, o_opts);
+    }
+
+    template<class Seq>
+    struct OpTable;
+
+    template<uint32_t... Ops>
+    struct OpTable<IndexSeq<Ops...>>
+    {
+        // Handler index for every opcode.
+        static constexpr uint16_t indices[] = { handlerIndex(uint16_t(Ops))... };
+    };
+
+    template<uint32_t... Ops>
+    constexpr uint16_t OpTable<IndexSeq<Ops...>>::indices[];
+
+    template<class Seq>
+    struct HandlerTable;
+
+    template<uint32_t... Is>
+    struct HandlerTable<IndexSeq<Is...>>
+    {
+        static constexpr TableHandler handlers[] = { tableOp<handlerKind(Is), handlerX(Is), handlerY(Is)>... };
+    };
+
+    template<uint32_t... Is>
+    constexpr TableHandler HandlerTable<IndexSeq<Is...>>::handlers[];
+
+    using OpIndices     = OpTable<MakeSeq<0x10000>::Type>;
+    using TableHandlers = HandlerTable<MakeSeq<NUM_TABLE_HANDLERS>::Type>;
+
+    // Fetches straight from memory, so there's no decode cache to keep in
+    // sync with writes.
+    static uint32_t runTable(System* sys, CycleOpts* o_opts, uint32_t maxOps)
+    {
+        uint32_t numOps = 0;
+
+        while (numOps < maxOps && o_opts->exit == RUN_BUDGET)
+        {
+            if (sys->pc > sizeof(sys->mem) - 2)
+            {
+                // Ran off the end of memory, as in `fetchInstr`.
+                sys->op      = 0;
+                o_opts->exit = RUN_UNKNOWN_OP;
+                ++sys->cycles;
+                ++numOps;
+                break;
+            }
+
+            const uint16_t hi = sys->mem[sys->pc + 0];
+            const uint16_t lo = sys->mem[sys->pc + 1];
+            const uint16_t op = (hi << 8) | lo;
+
+            sys->pc += 2;
+            sys->op  = op;
+            ++sys->cycles;
+
+            TableHandlers::handlers[OpIndices::indices[op]](sys, op, o_opts);
+            ++numOps;
+        }
+
+        return numOps;
+    }
+
+    using RunFn  = uint32_t (*)(System* sys, CycleOpts* o_opts, uint32_t maxOps);
+    using ExecFn = void (*)(System* sys, const Instr& instr, CycleOpts* o_opts);
+
+    // The engines that support quirks, instantiated for every profile, and
+    // indexed by it.
+    template<class Seq>
+    struct QuirkEngines;
+
+    template<uint32_t... Qs>
+    struct QuirkEngines<IndexSeq<Qs...>>
+    {
+        static constexpr ExecFn exec[]     = { execOpCode<Qs>... };
+        static constexpr RunFn  switches[] = { runSwitch<Qs>... };
+        static constexpr RunFn  fused[]    = { runFused<Qs>... };
+#if defined(__GNUC__)
+        static constexpr RunFn  threaded[] = { runThreaded<Qs>... };
+#endif
+    };
+
+    template<uint32_t... Qs>
+    constexpr ExecFn QuirkEngines<IndexSeq<Qs...>>::exec[];
+
+    template<uint32_t... Qs>
+    constexpr RunFn QuirkEngines<IndexSeq<Qs...>>::switches[];
+
+    template<uint32_t... Qs>
+    constexpr RunFn QuirkEngines<IndexSeq<Qs...>>::fused[];
+
+#if defined(__GNUC__)
+    template<uint32_t... Qs>
+    constexpr RunFn QuirkEngines<IndexSeq<Qs...>>::threaded[];
+#endif
+
+    using QuirkProfiles = QuirkEngines<MakeSeq<QUIRKS_ALL + 1>::Type>;
+
+    static bool supportsQuirks(Engine engine)
+    {
+        return (engine == ENGINE_SWITCH || engine == ENGINE_THREADED || engine == ENGINE_FUSED);
+    }
+
+    static uint32_t runEngine(System* sys, CycleOpts* o_opts, uint32_t maxOps)
+    {
+        switch (sys->engine)
+        {
+            case ENGINE_TABLE:
+                return runTable(sys, o_opts, maxOps);
+
+            case ENGINE_FUSED:
+                return QuirkProfiles::fused[sys->quirks](sys, o_opts, maxOps);
+
+            case ENGINE_AOT:
+                return runAot(sys, o_opts, maxOps);
+
+            case ENGINE_JIT:
+                return runJit(sys, o_opts, maxOps);
+
+#if defined(__GNUC__)
+            case ENGINE_THREADED:
+                return QuirkProfiles::threaded[sys->quirks](sys, o_opts, maxOps);
+#endif
+
+            default:
+                return QuirkProfiles::switches[sys->quirks](sys, o_opts, maxOps);
+        }
+    }
+
+    static AotProgram* s_aotPrograms = nullptr;
+
+    static const AotProgram* findAot(const System* sys)
+    {
+        for (const AotProgram* program = s_aotPrograms; program; program = program->next)
+        {
+            if (program->romSize <= sizeof(sys->mem) - 0x200 && memcmp(sys->mem + 0x200, program->rom, program->romSize) == 0)
+            {
+                return program;
+            }
+        }
+
+        return nullptr;
+    }
+
+    static void updateSound(System* sys)
+    {
+        if (sys->soundEnd && currentTick(sys) >= sys->soundEnd)
+        {
+            sys->soundEnd = 0;
+
+            if (!sys->muted)
+            {
+                putc('\a', stdout);
+                fflush(stdout);
+            }
+        }
+    }
+
+    // Whether the CPU, about to run the instruction at its pc, is in a loop
+    // that changes nothing until the next timer tick.
+    static bool isIdle(const System* sys)
+    {
+        const uint16_t pc = sys->pc;
+
+        if (pc > sizeof(sys->mem) - 2)
+        {
+            return false;
+        }
+
+        const uint16_t op = readOp(sys, pc);
+
+        if (op == (0x1000 | pc))
+        {
+            // Jump to self.
+            return true;
+        }
+
+        if ((sys->quirks & QUIRK_DISPLAY_WAIT) && (op & 0xF000) == 0xD000)
+        {
+            // DXYN retrying until it may draw again.
+            return currentTick(sys) < sys->drawTick;
+        }
+
+        // FX07 ; 3XNN ; 1NNN back to the FX07, waiting for the delay timer to
+        // reach NN, with the pc on any of the three.
+        for (uint16_t offset = 0; offset <= 4 && offset <= pc; offset += 2)
+        {
+            const uint16_t start = pc - offset;
+
+            if (start > sizeof(sys->mem) - 6)
+            {
+                continue;
+            }
+
+            const uint16_t load = readOp(sys, start + 0);
+            const uint16_t skip = readOp(sys, start + 2);
+            const uint16_t jump = readOp(sys, start + 4);
+
+            if ((load & 0xF0FF) == 0xF007 && (skip & 0xF000) == 0x3000 && (load & 0x0F00) == (skip & 0x0F00) && jump == (0x1000 | start))
+            {
+                // The timer holds still until the next tick, so the loop only
+                // leaves during this one if it already reads NN, or if VX was
+                // loaded with NN and the pc is about to compare it.
+                const uint8_t x  = uint8_t((load >> 8) & 0xF);
+                const uint8_t nn = uint8_t(skip & 0xFF);
+                return timerValue(sys, sys->delayEnd) != nn && (offset != 2 || sys->V[x] != nn);
+            }
+        }
+
+        return false;
+    }
+
+    void systemInit(System* sys)
+    {
+        memset(sys, 0, sizeof(*sys));
+        memcpy(sys->mem, CHIP8_FONT, sizeof(CHIP8_FONT));
+        sys->pc      = 0x200;
+        sys->cycleHz = DEFAULT_CYCLE_HZ;
+        systemSeed(sys, 0);
+    }
+
+    void systemShutdown(System* sys)
+    {
+        jitDestroy(sys->jit);
+        sys->jit = nullptr;
+    }
+
+    void systemProgramMem(System* sys, void** o_buf, uint16_t* o_maxSize)
+    {
+        *o_buf     = sys->mem + 0x200;
+        *o_maxSize = sizeof(sys->mem) - 0x200;
+
+        // The caller is about to write the program, so nothing decoded from
+        // this range can be trusted anymore, nor any translation of it.
+        invalidateCode(sys, 0x200, *o_maxSize);
+        sys->aot = nullptr;
+    }
+
+    void systemSeed(System* sys, uint32_t seed)
+    {
+        // Xorshift gets stuck on zero.
+        sys->rng = (seed ? seed : 0x2545F491);
+    }
+
+    bool systemSetEngine(System* sys, Engine engine)
+    {
+        switch (engine)
+        {
+            case ENGINE_SWITCH:
+            case ENGINE_FUSED:
+            case ENGINE_TABLE:
+                break;
+
+            case ENGINE_THREADED:
+#if defined(__GNUC__)
+                break;
+#else
+                return false;
+#endif
+
+            case ENGINE_JIT:
+                if (!sys->jit && !(sys->jit = jitCreate()))
+                {
+                    return false;
+                }
+
+                break;
+
+            case ENGINE_AOT:
+                if (!(sys->aot = findAot(sys)))
+                {
+                    return false;
+                }
+
+                // Found by its ROM, which memory holds all of.
+                memset(sys->aotStale, 0, sizeof(sys->aotStale));
+                sys->numAotStale = 0;
+
+                break;
+
+            default:
+                return false;
+        }
+
+        if (sys->quirks && !supportsQuirks(engine))
+        {
+            return false;
+        }
+
+        // Fused groups are only decoded for ENGINE_FUSED.
+        if ((sys->engine == ENGINE_FUSED) != (engine == ENGINE_FUSED))
+        {
+            memset(sys->decoded, 0, sizeof(sys->decoded));
+        }
+
+        sys->engine = engine;
+        return true;
+    }
+
+    bool systemSetQuirks(System* sys, uint8_t quirks)
+    {
+        if ((quirks & ~QUIRKS_ALL) || (quirks && !supportsQuirks(sys->engine)))
+        {
+            return false;
+        }
+
+        sys->quirks = quirks;
+        return true;
+    }
+
+    void systemRegisterAot(AotProgram* program)
+    {
+        program->next = s_aotPrograms;
+        s_aotPrograms = program;
+    }
+
+    void systemExecOp(System* sys, uint16_t opcode, CycleOpts* o_opts)
+    {
+        Instr instr;
+        decodeOpCode(opcode, &instr);
+        sys->op = opcode;
+        QuirkProfiles::exec[sys->quirks](sys, instr, o_opts);
+    }
+
+    void systemCycle(System* sys, CycleOpts* o_opts)
+    {
+        runEngine(sys, o_opts, 1);
+        updateSound(sys);
+    }
+
+    void systemRun(System* sys, uint64_t maxCycles, RunResult* o_result)
+    {
+        const uint64_t start = sys->cycles;
+        CycleOpts      opts;
+        bool           idle = false;
+
+        while (maxCycles && opts.exit == RUN_BUDGET)
+        {
+            uint64_t budget = maxCycles;
+
+            if (sys->stopIdle)
+            {
+                // Only the timers change anything the CPU can't, and only
+                // when they tick, so checking about once a tick is enough.
+                idle = isIdle(sys);
+
+                if (idle)
+                {
+                    break;
+                }
+
+                const uint64_t tickCycles = (sys->cycleHz > TIMER_HZ ? sys->cycleHz / TIMER_HZ : 1);
+                budget = (tickCycles < budget ? tickCycles : budget);
+            }
+
+            const uint32_t maxOps = uint32_t(budget < UINT32_MAX ? budget : UINT32_MAX);
+            maxCycles -= runEngine(sys, &opts, maxOps);
+        }
+
+        // The keys can't change during a run, so a CPU waiting for one would
+        // only retry FX0A for the rest of it. Skip to the end instead, which
+        // keeps the timers running down as they would have.
+        if (opts.exit == RUN_WAIT_KEY)
+        {
+            sys->cycles += maxCycles;
+        }
+
+        updateSound(sys);
+
+        o_result->cycles = sys->cycles - start;
+        o_result->exit   = opts.exit;
+        o_result->idle   = idle;
+    }
+
+    void systemSave(const System* sys, SystemState* o_state)
+    {
+        memcpy(o_state->mem, sys->mem, sizeof(sys->mem));
+        memcpy(o_state->fb, sys->fb, sizeof(sys->fb));
+        memcpy(o_state->stack, sys->stack, sizeof(sys->stack));
+        memcpy(o_state->V, sys->V, sizeof(sys->V));
+        o_state->cycles   = sys->cycles;
+        o_state->delayEnd = sys->delayEnd;
+        o_state->soundEnd = sys->soundEnd;
+        o_state->drawTick = sys->drawTick;
+        o_state->op       = sys->op;
+        o_state->keys     = sys->keys;
+        o_state->I        = sys->I;
+        o_state->pc       = sys->pc;
+        o_state->rng      = sys->rng;
+        o_state->sp       = sys->sp;
+    }
+
+    void systemRestore(System* sys, const SystemState* state)
+    {
+        // Programs rarely write to memory, and even more rarely to their
+        // code, so only look closer at the blocks that differ, and copy back
+        // and drop what was decoded from the bytes that differ alone. Data
+        // next to code then leaves the code be.
+        static constexpr uint32_t BLOCK_SIZE = 64;
+
+        for (uint32_t block = 0; block < sizeof(sys->mem); block += BLOCK_SIZE)
+        {
+            if (memcmp(sys->mem + block, state->mem + block, BLOCK_SIZE) == 0)
+            {
+                continue;
+            }
+
+            for (uint32_t addr = block; addr < block + BLOCK_SIZE; ++addr)
+            {
+                if (sys->mem[addr] != state->mem[addr])
+                {
+                    uint32_t end = addr + 1;
+
+                    while (end < block + BLOCK_SIZE && sys->mem[end] != state->mem[end])
+                    {
+                        ++end;
+                    }
+
+                    memcpy(sys->mem + addr, state->mem + addr, end - addr);
+                    invalidateCode(sys, uint16_t(addr), uint16_t(end - addr));
+                    addr = end;
+                }
+            }
+        }
+
+        memcpy(sys->fb, state->fb, sizeof(sys->fb));
+        memcpy(sys->stack, state->stack, sizeof(sys->stack));
+        memcpy(sys->V, state->V, sizeof(sys->V));
+        sys->cycles   = state->cycles;
+        sys->delayEnd = state->delayEnd;
+        sys->soundEnd = state->soundEnd;
+        sys->drawTick = state->drawTick;
+        sys->op       = state->op;
+        sys->keys     = state->keys;
+        sys->I        = state->I;
+        sys->pc       = state->pc;
+        sys->rng      = state->rng;
+        sys->sp       = state->sp;
+    }
+
+    static void hashBytes(uint64_t* io_hash, const void* data, size_t size)
+    {
+        // FNV-1a.
+        const uint8_t* bytes = (const uint8_t*)data;
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            *io_hash = (*io_hash ^ bytes[i]) * 0x100000001B3;
+        }
+    }
+
+    uint64_t systemHash(const System* sys)
+    {
+        uint64_t hash = 0xCBF29CE484222325;
+        hashBytes(&hash, sys->mem, sizeof(sys->mem));
+        hashBytes(&hash, sys->fb, sizeof(sys->fb));
+        hashBytes(&hash, sys->stack, sizeof(sys->stack));
+        hashBytes(&hash, sys->V, sizeof(sys->V));
+        hashBytes(&hash, &sys->cycles, sizeof(sys->cycles));
+        hashBytes(&hash, &sys->delayEnd, sizeof(sys->delayEnd));
+        hashBytes(&hash, &sys->soundEnd, sizeof(sys->soundEnd));
+        hashBytes(&hash, &sys->drawTick, sizeof(sys->drawTick));
+        hashBytes(&hash, &sys->keys, sizeof(sys->keys));
+        hashBytes(&hash, &sys->I, sizeof(sys->I));
+        hashBytes(&hash, &sys->pc, sizeof(sys->pc));
+        hashBytes(&hash, &sys->rng, sizeof(sys->rng));
+        hashBytes(&hash, &sys->sp, sizeof(sys->sp));
+        return hash;
+    }
+
+    uint8_t systemDelayTimer(const System* sys)
+    {
+        return timerValue(sys, sys->delayEnd);
+    }
+
+    uint8_t systemSoundTimer(const System* sys)
+    {
+        return timerValue(sys, sys->soundEnd);
     }
 
     void systemDisasm(uint16_t opcode, DisasmStr& o_str)
@@ -8,6 +8,46 @@
 namespace c8e
 {
 
+    enum Engine : uint8_t
+    {
+        ENGINE_SWITCH,
+        ENGINE_THREADED,
+        ENGINE_JIT,
+        ENGINE_AOT,
+        ENGINE_FUSED,
+        ENGINE_TABLE,
+    };
+
+    // Behaviors that differ between CHIP-8 implementations, and that ROMs
+    // written for one of them may rely on. None set is how c8e has always
+    // behaved.
+    enum Quirk : uint8_t
+    {
+        QUIRK_SHIFT_VY     = (1 << 0), // 8XY6/8XYE shift VY into VX, rather than shifting VX.
+        QUIRK_INC_I        = (1 << 1), // FX55/FX65 leave I past the last register accessed.
+        QUIRK_JUMP_VX      = (1 << 2), // BXNN jumps to XNN plus VX, rather than BNNN to NNN plus V0.
+        QUIRK_CLIP_SPRITES = (1 << 3), // DXYN clips sprites at the screen edges, rather than wrapping them.
+        QUIRK_VF_RESET     = (1 << 4), // 8XY1/8XY2/8XY3 set VF to zero.
+        QUIRK_DISPLAY_WAIT = (1 << 5), // DXYN waits for the next timer tick if it already drew during this one.
+        QUIRKS_ALL         = (1 << 6) - 1,
+    };
+
+    // Instructions per emulated second, unless the frontend picks a rate.
+    constexpr uint32_t DEFAULT_CYCLE_HZ = 540;
+
+    struct AotProgram;
+    struct Jit;
+
+    struct Instr
+    {
+        uint16_t op;
+        uint16_t nnn;
+        uint8_t  kind;
+        uint8_t  x;
+        uint8_t  y;
+        uint8_t  nn;
+    };
+
     struct System
     {
         using Fb = uint64_t[32];
@@ -35,17 +75,24 @@ namespace c8e
         uint16_t op;
         uint8_t  mem[4096];
         Fb       fb;
+        uint32_t fbDirty; // Rows of `fb` changed since the caller last cleared this, row 0 in bit 0.
         uint16_t keys;
 
-        uint8_t  delayTimer;
-        uint8_t  soundTimer;
-        struct timespec nextTick;
+        // The timers are not counted down as such, but kept as the timer
+        // tick at which they reach zero. Timer ticks are derived from the
+        // number of instructions executed.
+        uint64_t cycles;   // Instructions executed, or skipped while idle.
+        uint32_t cycleHz;  // Instructions per emulated second.
+        uint64_t delayEnd;
+        uint64_t soundEnd; // Zero if the sound timer is not running.
+        uint64_t drawTick; // The tick from which DXYN may draw again, for QUIRK_DISPLAY_WAIT.
 
         uint16_t stack[16];
         int8_t   sp;
 
         uint16_t I;
         uint16_t pc;
+        uint32_t rng; // Random number generator state, never zero.
 
         union
         {
@@ -72,19 +119,105 @@ namespace c8e
             uint8_t V[16];
         };
 
+        Engine            engine;
+        uint8_t           quirks; // Combination of Quirk flags.
+        bool              muted;  // Don't play sound, as for runs that will be rolled back.
+        bool              stopIdle; // Have systemRun stop when the CPU idles until the next timer tick, for callers to skip ahead.
+        Jit*              jit;
+        const AotProgram* aot;
+        uint8_t           aotStale[4096 / 8]; // Bytes `aot` translated that no longer hold the ROM's code, one bit each.
+        uint32_t          numAotStale;        // `aot` only runs while none are.
+        uint64_t          numFused; // Fused instruction groups executed.
+
+        // Decoded instructions, one per even address in `mem`. Entries are
+        // decoded on first execution, and dropped whenever the memory they
+        // were decoded from is written to.
+        Instr decoded[sizeof(mem) / 2];
+
     }; // struct System
 
 
+    // Why the CPU stopped running. The pc is left on the instruction that
+    // caused a wait or a fault, to run it again once resolved.
+    enum RunExit : uint8_t
+    {
+        RUN_BUDGET,      // Ran every cycle it was given.
+        RUN_FB_UPDATED,  // Drew to, or cleared, the framebuffer.
+        RUN_WAIT_KEY,    // FX0A is waiting for a key to be pressed. systemRun spends the rest of its cycles waiting.
+        RUN_UNKNOWN_OP,  // Reached an opcode that doesn't exist.
+        RUN_STACK_FAULT, // Reached a call with a full stack, or a return with an empty one.
+    };
+
     struct CycleOpts
     {
-        bool fbUpdated{false};
+        RunExit exit{RUN_BUDGET}; // Out
+    };
+
+    struct RunResult
+    {
+        uint64_t cycles; // Cycles run, counting ones that ended in a wait or a fault.
+        RunExit  exit;
+        bool     idle;   // Stopped early, as System::stopIdle asked, with the CPU idle until the next timer tick.
+    };
+
+    // A ROM translated ahead of time by c8e-aot. `run` executes from the
+    // current pc, and returns the number of instructions executed; zero if
+    // the pc is not the start of any translated block.
+    struct AotProgram
+    {
+        const uint8_t* rom;
+        uint16_t       romSize;
+        const uint8_t* codeMap; // One bit per translated byte of `mem`.
+        uint32_t     (*run)(System* sys, CycleOpts* o_opts, uint32_t maxOps);
+        AotProgram*    next;
+    };
+
+    // Everything a running program can observe or change, to roll a system
+    // back to. That leaves out what's derived from it, like decoded code.
+    struct SystemState
+    {
+        uint8_t    mem[4096];
+        System::Fb fb;
+        uint64_t   cycles;
+        uint64_t   delayEnd;
+        uint64_t   soundEnd;
+        uint64_t   drawTick;
+        uint16_t   stack[16];
+        uint16_t   op;
+        uint16_t   keys;
+        uint16_t   I;
+        uint16_t   pc;
+        uint32_t   rng;
+        uint8_t    V[16];
+        int8_t     sp;
     };
 
     using DisasmStr = char[16];
 
     void systemInit(System* sys);
+    void systemShutdown(System* sys);
     void systemProgramMem(System* sys, void** o_buf, uint16_t* o_maxSize);
+    void systemSeed(System* sys, uint32_t seed);
+    bool systemSetEngine(System* sys, Engine engine); // After loading the program, for ENGINE_AOT.
+    bool systemSetQuirks(System* sys, uint8_t quirks); // Only the switch, threaded and fused engines support any.
+    void systemRegisterAot(AotProgram* program);
+    void systemExecOp(System* sys, uint16_t opcode, CycleOpts* o_opts);
     void systemCycle(System *sys, CycleOpts* o_opts);
+    void systemRun(System* sys, uint64_t maxCycles, RunResult* o_result);
+    void systemSave(const System* sys, SystemState* o_state);
+    void systemRestore(System* sys, const SystemState* state);
+    uint64_t systemHash(const System* sys); // Of the state systemSave keeps, but `op`, which not all engines update.
+    uint8_t systemDelayTimer(const System* sys);
+    uint8_t systemSoundTimer(const System* sys);
     void systemDisasm(uint16_t opcode, DisasmStr& o_str);
 
+    // Registers an AotProgram during static initialization.
+    struct AotRegistrar
+    {
+        explicit AotRegistrar(AotProgram* program)
+        {
+            systemRegisterAot(program);
+        }
+    };
+
 } // namespace c8e
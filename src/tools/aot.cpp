@@ -0,0 +1,649 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../system.hpp"
+
+namespace c8e
+{
+
+    static constexpr uint16_t PROGRAM_START = 0x200;
+    static constexpr uint16_t MEM_SIZE      = sizeof(System::mem);
+
+    struct Rom
+    {
+        uint8_t  mem[MEM_SIZE];
+        uint16_t size;
+    };
+
+    struct Analysis
+    {
+        bool reached[MEM_SIZE]; // An instruction starts here.
+        bool leader[MEM_SIZE];  // A block starts here.
+    };
+
+    enum Flow
+    {
+        FLOW_NEXT,      // Continues with the next instruction.
+        FLOW_JUMP,      // Continues at NNN.
+        FLOW_CALL,      // Continues at NNN, and later the next instruction.
+        FLOW_SKIP,      // Continues with the next or the one after.
+        FLOW_INDIRECT,  // Continues wherever the pc says.
+        FLOW_EXIT,      // Hands control back to the caller after executing.
+        FLOW_WAIT,      // Like FLOW_EXIT, but may be executed more than once.
+        FLOW_STOP,      // Unknown instruction, interpreted and never followed.
+    };
+
+    static uint16_t readOp(const Rom& rom, uint16_t addr)
+    {
+        return (rom.mem[addr] << 8) | rom.mem[addr + 1];
+    }
+
+    static bool inRom(const Rom& rom, uint32_t addr)
+    {
+        return addr >= PROGRAM_START && addr + 1 < uint32_t(PROGRAM_START) + rom.size;
+    }
+
+    static Flow opFlow(uint16_t op)
+    {
+        switch (op & 0xF000)
+        {
+            case 0x0000:
+                switch (op)
+                {
+                    case 0x00E0: return FLOW_EXIT;
+                    case 0x00EE: return FLOW_INDIRECT;
+                    default:     return FLOW_NEXT;
+                }
+
+            case 0x1000: return FLOW_JUMP;
+            case 0x2000: return FLOW_CALL;
+            case 0x3000: return FLOW_SKIP;
+            case 0x4000: return FLOW_SKIP;
+            case 0x5000: return FLOW_SKIP;
+
+            case 0x8000:
+                switch (op & 0x000F)
+                {
+                    case 0x0008: case 0x0009: case 0x000A: case 0x000B:
+                    case 0x000C: case 0x000D: case 0x000F:
+                        return FLOW_STOP;
+
+                    default:
+                        return FLOW_NEXT;
+                }
+
+            case 0x9000: return FLOW_SKIP;
+            case 0xB000: return FLOW_INDIRECT;
+            case 0xD000: return FLOW_EXIT;
+
+            case 0xE000:
+                switch (op & 0x00FF)
+                {
+                    case 0x009E: return FLOW_SKIP;
+                    case 0x00A1: return FLOW_SKIP;
+                    default:     return FLOW_STOP;
+                }
+
+            case 0xF000:
+                switch (op & 0x00FF)
+                {
+                    case 0x000A: return FLOW_WAIT;
+                    case 0x0033: return FLOW_EXIT; // May overwrite code.
+                    case 0x0055: return FLOW_EXIT; // May overwrite code.
+
+                    case 0x0007: case 0x0015: case 0x0018: case 0x001E:
+                    case 0x0029: case 0x0065:
+                        return FLOW_NEXT;
+
+                    default:
+                        return FLOW_STOP;
+                }
+
+            default:
+                return FLOW_NEXT;
+        }
+    }
+
+    static void addTarget(Analysis* analysis, uint16_t* pending, uint32_t* numPending, uint32_t addr, bool leader)
+    {
+        if (addr < MEM_SIZE)
+        {
+            analysis->leader[addr] |= leader;
+            pending[(*numPending)++] = uint16_t(addr);
+        }
+    }
+
+    // Finds all instructions reachable through direct control flow from the
+    // program start, and where the blocks between them begin.
+    static void analyze(const Rom& rom, Analysis* o_analysis)
+    {
+        memset(o_analysis, 0, sizeof(*o_analysis));
+
+        // Every reached instruction adds at most two more.
+        uint16_t pending[MEM_SIZE * 2 + 1];
+        uint32_t numPending = 0;
+
+        addTarget(o_analysis, pending, &numPending, PROGRAM_START, true);
+
+        while (numPending)
+        {
+            const uint16_t addr = pending[--numPending];
+
+            if (!inRom(rom, addr) || o_analysis->reached[addr])
+            {
+                continue;
+            }
+
+            o_analysis->reached[addr] = true;
+
+            const uint16_t op   = readOp(rom, addr);
+            const uint16_t nnn  = op & 0x0FFF;
+            const uint16_t next = addr + 2;
+
+            switch (opFlow(op))
+            {
+                case FLOW_NEXT:
+                    addTarget(o_analysis, pending, &numPending, next, false);
+                    break;
+
+                case FLOW_JUMP:
+                    addTarget(o_analysis, pending, &numPending, nnn, true);
+                    break;
+
+                case FLOW_CALL:
+                    addTarget(o_analysis, pending, &numPending, nnn, true);
+                    addTarget(o_analysis, pending, &numPending, next, true);
+                    break;
+
+                case FLOW_SKIP:
+                    addTarget(o_analysis, pending, &numPending, next, true);
+                    addTarget(o_analysis, pending, &numPending, next + 2, true);
+                    break;
+
+                case FLOW_WAIT:
+                    o_analysis->leader[addr] = true;
+                    // Fall through.
+
+                case FLOW_EXIT:
+                    addTarget(o_analysis, pending, &numPending, next, true);
+                    break;
+
+                case FLOW_INDIRECT:
+                case FLOW_STOP:
+                    break;
+            }
+        }
+    }
+
+    static void emitGoto(FILE* out, const Analysis& analysis, uint16_t addr, const char* indent = "        ")
+    {
+        if (addr < MEM_SIZE && analysis.reached[addr])
+        {
+            fprintf(out, "%sgoto L_%03X;\n", indent, addr);
+        }
+        else
+        {
+            // Not found statically, so leave it to the interpreter.
+            fprintf(out, "%ssys->pc = 0x%03X;\n", indent, addr);
+            fprintf(out, "%sreturn numOps;\n", indent);
+        }
+    }
+
+    // `pending` is the number of instructions left in the block after this
+    // one. They have been counted already, so they are taken back out of the
+    // cycle count while the interpreter runs, for the timers to see the same
+    // count they would when interpreting the whole block.
+    static void emitInterpreted(FILE* out, uint16_t op, uint16_t next, uint32_t pending = 0)
+    {
+        fprintf(out, "        sys->pc = 0x%03X;\n", next);
+
+        if (pending)
+        {
+            fprintf(out, "        sys->cycles -= %u;\n", pending);
+        }
+
+        fprintf(out, "        c8e::systemExecOp(sys, 0x%04X, o_opts);\n", op);
+
+        if (pending)
+        {
+            fprintf(out, "        sys->cycles += %u;\n", pending);
+        }
+    }
+
+    // Leaves the pc on the instruction at `addr`, the last of its block, if
+    // it would over- or underflow the stack.
+    static void emitStackCheck(FILE* out, const char* cond, uint16_t addr)
+    {
+        fprintf(out, "        if (%s)\n", cond);
+        fprintf(out, "        {\n");
+        fprintf(out, "            sys->pc      = 0x%03X;\n", addr);
+        fprintf(out, "            o_opts->exit = c8e::RUN_STACK_FAULT;\n");
+        fprintf(out, "            return numOps;\n");
+        fprintf(out, "        }\n");
+        fprintf(out, "\n");
+    }
+
+    // Emits the instruction, and returns whether it ended the block.
+    static bool emitOp(FILE* out, const Analysis& analysis, uint16_t addr, uint16_t op, uint32_t pending)
+    {
+        const uint8_t  x    = (op & 0x0F00) >> 8;
+        const uint8_t  y    = (op & 0x00F0) >> 4;
+        const uint8_t  nn   = (op & 0x00FF);
+        const uint16_t nnn  = (op & 0x0FFF);
+        const uint16_t next = addr + 2;
+
+        DisasmStr dasm;
+        systemDisasm(op, dasm);
+        fprintf(out, "        // 0x%03X  %04X  %s\n", addr, op, dasm);
+
+        switch (opFlow(op))
+        {
+            case FLOW_JUMP:
+                emitGoto(out, analysis, nnn);
+                return true;
+
+            case FLOW_CALL:
+                emitStackCheck(out, "sys->sp >= 16", addr);
+                fprintf(out, "        sys->stack[(sys->sp)++] = 0x%03X;\n", next);
+                emitGoto(out, analysis, nnn);
+                return true;
+
+            case FLOW_SKIP:
+                switch (op & 0xF000)
+                {
+                    case 0x3000:
+                        fprintf(out, "        if (sys->V[0x%X] == 0x%02X)\n", x, nn);
+                        break;
+
+                    case 0x4000:
+                        fprintf(out, "        if (sys->V[0x%X] != 0x%02X)\n", x, nn);
+                        break;
+
+                    case 0x5000:
+                        fprintf(out, "        if (sys->V[0x%X] == sys->V[0x%X])\n", x, y);
+                        break;
+
+                    default:
+                        // Left to the interpreter, which updates the pc.
+                        emitInterpreted(out, op, next);
+                        fprintf(out, "        goto dispatch;\n");
+                        return true;
+                }
+
+                fprintf(out, "        {\n");
+                emitGoto(out, analysis, next + 2, "            ");
+                fprintf(out, "        }\n");
+                emitGoto(out, analysis, next);
+                return true;
+
+            case FLOW_INDIRECT:
+                if (op == 0x00EE)
+                {
+                    emitStackCheck(out, "sys->sp <= 0", addr);
+                    fprintf(out, "        sys->pc = sys->stack[--(sys->sp)];\n");
+                }
+                else
+                {
+                    emitInterpreted(out, op, next);
+                }
+
+                fprintf(out, "        goto dispatch;\n");
+                return true;
+
+            case FLOW_EXIT:
+            case FLOW_WAIT:
+            case FLOW_STOP:
+                emitInterpreted(out, op, next);
+                fprintf(out, "        return numOps;\n");
+                return true;
+
+            case FLOW_NEXT:
+                break;
+        }
+
+        switch (op & 0xF000)
+        {
+            case 0x0000: // 0x0NNN is ignored.
+                break;
+
+            case 0x6000:
+                fprintf(out, "        sys->V[0x%X] = 0x%02X;\n", x, nn);
+                break;
+
+            case 0x7000:
+                fprintf(out, "        sys->V[0x%X] += 0x%02X;\n", x, nn);
+                break;
+
+            case 0x8000:
+                switch (op & 0x000F)
+                {
+                    case 0x0000:
+                        fprintf(out, "        sys->V[0x%X] = sys->V[0x%X];\n", x, y);
+                        break;
+
+                    case 0x0001:
+                        fprintf(out, "        sys->V[0x%X] |= sys->V[0x%X];\n", x, y);
+                        break;
+
+                    case 0x0002:
+                        fprintf(out, "        sys->V[0x%X] &= sys->V[0x%X];\n", x, y);
+                        break;
+
+                    case 0x0003:
+                        fprintf(out, "        sys->V[0x%X] ^= sys->V[0x%X];\n", x, y);
+                        break;
+
+                    case 0x0004:
+                        fprintf(out, "        {\n");
+                        fprintf(out, "            const uint16_t res = sys->V[0x%X] + sys->V[0x%X];\n", x, y);
+                        fprintf(out, "            sys->V[0x%X] = uint8_t(res);\n", x);
+                        fprintf(out, "            sys->VF = (res >> 8 ? 1 : 0);\n");
+                        fprintf(out, "        }\n");
+                        break;
+
+                    case 0x0005:
+                    case 0x0007:
+                    {
+                        const bool rev = (op & 0x000F) == 0x0007;
+                        fprintf(out, "        {\n");
+                        fprintf(out, "            const uint16_t res = sys->V[0x%X] - sys->V[0x%X];\n", rev ? y : x, rev ? x : y);
+                        fprintf(out, "            sys->V[0x%X] = uint8_t(res);\n", x);
+                        fprintf(out, "            sys->VF = (res >> 8 ? 0 : 1);\n");
+                        fprintf(out, "        }\n");
+                        break;
+                    }
+
+                    case 0x0006:
+                        fprintf(out, "        sys->VF = (sys->V[0x%X] & 1);\n", x);
+                        fprintf(out, "        sys->V[0x%X] >>= 1;\n", x);
+                        break;
+
+                    case 0x000E:
+                        fprintf(out, "        sys->VF = (sys->V[0x%X] & 0x80) >> 7;\n", x);
+                        fprintf(out, "        sys->V[0x%X] <<= 1;\n", x);
+                        break;
+                }
+
+                break;
+
+            case 0xA000:
+                fprintf(out, "        sys->I = 0x%03X;\n", nnn);
+                break;
+
+            case 0xF000:
+                switch (op & 0x00FF)
+                {
+                    case 0x001E:
+                        fprintf(out, "        sys->I += sys->V[0x%X];\n", x);
+                        break;
+
+                    case 0x0029:
+                        fprintf(out, "        sys->I = sys->V[0x%X] * 5;\n", x);
+                        break;
+
+                    default:
+                        emitInterpreted(out, op, next, pending);
+                        break;
+                }
+
+                break;
+
+            default:
+                emitInterpreted(out, op, next, pending);
+                break;
+        }
+
+        return false;
+    }
+
+    static void emitBlock(FILE* out, const Rom& rom, const Analysis& analysis, uint16_t start)
+    {
+        uint32_t numOps = 0;
+
+        for (uint16_t addr = start; ; addr += 2)
+        {
+            ++numOps;
+
+            const uint16_t next = addr + 2;
+
+            if (opFlow(readOp(rom, addr)) != FLOW_NEXT || !inRom(rom, next) || !analysis.reached[next] || analysis.leader[next])
+            {
+                break;
+            }
+        }
+
+        fprintf(out, "    L_%03X:\n", start);
+        fprintf(out, "        if (maxOps - numOps < %u)\n", numOps);
+        fprintf(out, "        {\n");
+        fprintf(out, "            sys->pc = 0x%03X;\n", start);
+        fprintf(out, "            return numOps;\n");
+        fprintf(out, "        }\n");
+        fprintf(out, "\n");
+        fprintf(out, "        numOps      += %u;\n", numOps);
+        fprintf(out, "        sys->cycles += %u;\n", numOps);
+        fprintf(out, "\n");
+
+        for (uint16_t addr = start; ; addr += 2)
+        {
+            const uint32_t pending = numOps - (addr - start) / 2 - 1;
+
+            if (emitOp(out, analysis, addr, readOp(rom, addr), pending))
+            {
+                break;
+            }
+
+            const uint16_t next = addr + 2;
+
+            if (!inRom(rom, next) || !analysis.reached[next] || analysis.leader[next])
+            {
+                emitGoto(out, analysis, next);
+                break;
+            }
+        }
+
+        fprintf(out, "\n");
+    }
+
+    // Whether any instruction continues at a pc only known at runtime.
+    static bool usesDispatch(const Rom& rom, const Analysis& analysis)
+    {
+        for (uint32_t addr = 0; addr < MEM_SIZE; ++addr)
+        {
+            if (analysis.reached[addr])
+            {
+                const uint16_t op = readOp(rom, uint16_t(addr));
+                const Flow flow = opFlow(op);
+
+                if (flow == FLOW_INDIRECT || (flow == FLOW_SKIP && ((op & 0xF000) == 0x9000 || (op & 0xF000) == 0xE000)))
+                {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    static void emitBytes(FILE* out, const uint8_t* bytes, uint32_t size)
+    {
+        for (uint32_t i = 0; i < size; ++i)
+        {
+            fprintf(out, "%s0x%02X,%s", (i % 16 == 0) ? "        " : "", bytes[i], (i % 16 == 15 || i + 1 == size) ? "\n" : " ");
+        }
+    }
+
+    static void emitProgram(FILE* out, const char* name, const Rom& rom, const Analysis& analysis)
+    {
+        uint8_t codeMap[MEM_SIZE / 8] = {};
+
+        for (uint32_t addr = 0; addr < MEM_SIZE; ++addr)
+        {
+            if (analysis.reached[addr])
+            {
+                codeMap[(addr + 0) / 8] |= uint8_t(1 << ((addr + 0) % 8));
+                codeMap[(addr + 1) / 8] |= uint8_t(1 << ((addr + 1) % 8));
+            }
+        }
+
+        fprintf(out, "//\n");
+        fprintf(out, "// Generated by c8e-aot from %s. Do not edit.\n", name);
+        fprintf(out, "//\n");
+        fprintf(out, "\n");
+        fprintf(out, "#include <cstdint>\n");
+        fprintf(out, "\n");
+        fprintf(out, "#include \"system.hpp\"\n");
+        fprintf(out, "\n");
+        fprintf(out, "namespace\n");
+        fprintf(out, "{\n");
+        fprintf(out, "\n");
+        fprintf(out, "    const uint8_t s_rom[] =\n");
+        fprintf(out, "    {\n");
+        emitBytes(out, rom.mem + PROGRAM_START, rom.size);
+        fprintf(out, "    };\n");
+        fprintf(out, "\n");
+        fprintf(out, "    const uint8_t s_codeMap[] =\n");
+        fprintf(out, "    {\n");
+        emitBytes(out, codeMap, sizeof(codeMap));
+        fprintf(out, "    };\n");
+        fprintf(out, "\n");
+        fprintf(out, "    uint32_t run(c8e::System* sys, c8e::CycleOpts* o_opts, uint32_t maxOps)\n");
+        fprintf(out, "    {\n");
+        fprintf(out, "        uint32_t numOps = 0;\n");
+        fprintf(out, "        (void)o_opts; // Unused if every instruction was translated.\n");
+        fprintf(out, "\n");
+        if (usesDispatch(rom, analysis))
+        {
+            fprintf(out, "    dispatch:\n");
+        }
+
+        fprintf(out, "        switch (sys->pc)\n");
+        fprintf(out, "        {\n");
+
+        for (uint32_t addr = 0; addr < MEM_SIZE; ++addr)
+        {
+            if (analysis.reached[addr] && analysis.leader[addr])
+            {
+                fprintf(out, "            case 0x%03X: goto L_%03X;\n", addr, addr);
+            }
+        }
+
+        fprintf(out, "            default:    return numOps;\n");
+        fprintf(out, "        }\n");
+        fprintf(out, "\n");
+
+        for (uint32_t addr = 0; addr < MEM_SIZE; ++addr)
+        {
+            if (analysis.reached[addr] && analysis.leader[addr])
+            {
+                emitBlock(out, rom, analysis, uint16_t(addr));
+            }
+        }
+
+        fprintf(out, "    }\n");
+        fprintf(out, "\n");
+        fprintf(out, "    c8e::AotProgram  s_program{s_rom, sizeof(s_rom), s_codeMap, run, nullptr};\n");
+        fprintf(out, "    c8e::AotRegistrar s_registrar{&s_program};\n");
+        fprintf(out, "\n");
+        fprintf(out, "} // namespace\n");
+    }
+
+    static const char* findBasename(const char* path)
+    {
+        const char* basename = path;
+
+        for (const char* ch = path; *ch; ++ch)
+        {
+            if (*ch == '/')
+            {
+                basename = ch + 1;
+            }
+        }
+
+        return basename;
+    }
+
+    static void showUsage(const char* prg)
+    {
+        const char* basename = findBasename(prg);
+
+        printf("%s: Translates a CHIP-8 ROM to C++ ahead of time.\n", basename);
+        printf("\n");
+        printf("Usage:\n");
+        printf("\n");
+        printf("  %s --help\n", basename);
+        printf("  %s <c8_path> <cpp_path>\n", basename);
+        printf("\n");
+        printf("Arguments:\n");
+        printf("\n");
+        printf("  --help\tShow this help and exit.\n");
+        printf("  c8_path\tPath to the CHIP-8 ROM to translate.\n");
+        printf("  cpp_path\tPath to write the C++ source to.\n");
+        printf("\n");
+        printf("Build the output into c8e, and run the ROM with --engine=aot.\n");
+        printf("\n");
+    }
+
+    static bool loadRom(const char* path, Rom* o_rom)
+    {
+        bool success = false;
+
+        memset(o_rom, 0, sizeof(*o_rom));
+
+        if (FILE* file = fopen(path, "rb"))
+        {
+            fseek(file, 0, SEEK_END);
+            const size_t size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+
+            if (size && size <= size_t(MEM_SIZE - PROGRAM_START))
+            {
+                const size_t read = fread(o_rom->mem + PROGRAM_START, 1, size, file);
+                o_rom->size = uint16_t(size);
+                success = (read == size);
+            }
+
+            fclose(file);
+        }
+
+        return success;
+    }
+
+} // namespace c8e
+
+int main(int argc, char** argv)
+{
+    if (argc != 3 || strcmp(argv[1], "--help") == 0)
+    {
+        c8e::showUsage(argv[0]);
+        return (argc == 2) ? 0 : 1;
+    }
+
+    static c8e::Rom      rom;
+    static c8e::Analysis analysis;
+
+    if (!c8e::loadRom(argv[1], &rom))
+    {
+        fprintf(stderr, "ERROR: Failed to load ROM %s.\n", argv[1]);
+        return 1;
+    }
+
+    c8e::analyze(rom, &analysis);
+
+    FILE* out = fopen(argv[2], "w");
+
+    if (!out)
+    {
+        fprintf(stderr, "ERROR: Failed to open %s for writing.\n", argv[2]);
+        return 1;
+    }
+
+    c8e::emitProgram(out, c8e::findBasename(argv[1]), rom, analysis);
+    fclose(out);
+}
@@ -0,0 +1,633 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "../parse.hpp"
+#include "../ring.hpp"
+#include "../runner.hpp"
+#include "../system.hpp"
+
+namespace c8e
+{
+
+    static constexpr uint32_t MAX_THREADS = 256;
+    static constexpr size_t   MAX_LINE    = 4096;
+
+    struct Args
+    {
+        bool        help{false};
+        uint32_t    threads{0};
+        uint64_t    cycles{DEFAULT_CYCLE_HZ * 10};
+        bool        skipIdle{false};
+        const char* ring{nullptr};
+        const char* path{nullptr};
+    };
+
+    struct Job
+    {
+        char*    rom;
+        char*    input;  // nullptr if no keys are pressed.
+        uint64_t cycles; // Zero to run the default budget.
+        uint64_t frames; // Zero to run `cycles`.
+        uint32_t hz;
+        uint32_t seed;
+        Engine   engine;
+        uint8_t  quirks;
+    };
+
+    struct JobList
+    {
+        Job*     jobs;
+        uint32_t count;
+        uint32_t capacity;
+    };
+
+    // Each worker owns a range of job indices, packed as begin in the low
+    // and end in the high half. The owner takes jobs from the front, and
+    // workers that run out steal the back half of someone else's. Ranges
+    // only shrink, and each index is handed out once, so a compare and swap
+    // can't be fooled by a range that comes back.
+    struct Worker
+    {
+        alignas(64) std::atomic<uint64_t> range; // Keeps each range on its own cache line.
+        std::thread           thread;
+        System*               sys;
+        uint32_t              numRun;
+        uint32_t              numStolen;
+    };
+
+    struct Batch
+    {
+        const Args*    args;
+        const JobList* list;
+        Worker         workers[MAX_THREADS]; // Not heap allocated, so the alignment holds before C++17.
+        uint32_t       numWorkers;
+        Ring*          ring; // nullptr unless frames are published.
+        std::mutex     outMutex;
+        std::atomic<uint32_t> numFailed;
+    };
+
+    static void showUsage(const char* prg)
+    {
+        const char* basename = runnerBasename(prg);
+
+        printf("%s: Runs a list of CHIP-8 jobs on all cores, and prints the results as NDJSON.\n", basename);
+        printf("\n");
+        printf("Usage:\n");
+        printf("\n");
+        printf("  %s --help\n", basename);
+        printf("  %s [--threads=<n>] [--cycles=<n>] [--ring=<name>] [--skip-idle] <jobs_path>\n", basename);
+        printf("\n");
+        printf("Arguments:\n");
+        printf("\n");
+        printf("  --help\tShow this help and exit.\n");
+        printf("  --threads\tWorker threads to run (default one per core).\n");
+        printf("  --cycles\tInstructions to run for jobs that don't say (default %llu).\n", (unsigned long long)(DEFAULT_CYCLE_HZ * 10));
+        printf("  --ring\tPublish every frame of every job to a ring in POSIX shared memory by this name,\n");
+        printf("        \tlike /c8e, with the job's index as the instance.\n");
+        printf("  --skip-idle\tSkip ahead to the next timer tick when a ROM idles until it. Changes the hashes.\n");
+        printf("  jobs_path\tPath to the job list, or - to read it from stdin.\n");
+        printf("\n");
+        printf("Jobs:\n");
+        printf("\n");
+        printf("  One per line, as the path to a ROM followed by any of these, separated\n");
+        printf("  by spaces. Empty lines and lines starting with # are skipped.\n");
+        printf("\n");
+        printf("  cycles=<n>\tInstructions to run.\n");
+        printf("  frames=<n>\tFrames to run, at 60 per second.\n");
+        printf("  hz=<n>\tInstructions per second (default %u).\n", unsigned(DEFAULT_CYCLE_HZ));
+        printf("  seed=<n>\tSeed for CXNN's random numbers.\n");
+        printf("  input=<path>\tKeys to press, as c8e --record writes them.\n");
+        printf("  engine=<name>\tAs for c8e.\n");
+        printf("  quirks=<names>\tAs for c8e.\n");
+        printf("\n");
+        printf("Results are written as each job finishes, so not in order; `job` is\n");
+        printf("the job's zero based index in the list.\n");
+        printf("\n");
+    }
+
+    static bool parseArgs(Args* args, int32_t argc, char** argv)
+    {
+        for (int32_t i = 1; i < argc; ++i)
+        {
+            uint64_t value;
+
+            if (strcmp(argv[i], "--help") == 0)
+            {
+                args->help = true;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--threads=", 10) == 0 && runnerParseNumber(argv[i] + 10, &value) && value && value <= MAX_THREADS)
+            {
+                args->threads = uint32_t(value);
+                continue;
+            }
+
+            if (strncmp(argv[i], "--cycles=", 9) == 0 && runnerParseNumber(argv[i] + 9, &value) && value)
+            {
+                args->cycles = value;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--ring=", 7) == 0)
+            {
+                args->ring = argv[i] + 7;
+                continue;
+            }
+
+            if (strcmp(argv[i], "--skip-idle") == 0)
+            {
+                args->skipIdle = true;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--", 2) == 0)
+            {
+                fprintf(stderr, "ERROR: Invalid argument %s.\n", argv[i]);
+                return false;
+            }
+
+            if (!args->path)
+            {
+                args->path = argv[i];
+            }
+        }
+
+        return true;
+    }
+
+    static char* copyString(const char* str)
+    {
+        const size_t size = strlen(str) + 1;
+        char*        copy = (char*)malloc(size);
+        memcpy(copy, str, size);
+        return copy;
+    }
+
+    static bool parseJobField(const char* field, Job* o_job)
+    {
+        uint64_t value;
+
+        if (strncmp(field, "cycles=", 7) == 0)
+        {
+            return runnerParseNumber(field + 7, &o_job->cycles) && o_job->cycles;
+        }
+
+        if (strncmp(field, "frames=", 7) == 0)
+        {
+            return runnerParseNumber(field + 7, &o_job->frames) && o_job->frames;
+        }
+
+        if (strncmp(field, "hz=", 3) == 0 && runnerParseNumber(field + 3, &value) && value && value <= (UINT32_MAX >> 1))
+        {
+            o_job->hz = uint32_t(value);
+            return true;
+        }
+
+        if (strncmp(field, "seed=", 5) == 0 && runnerParseNumber(field + 5, &value) && value <= UINT32_MAX)
+        {
+            o_job->seed = uint32_t(value);
+            return true;
+        }
+
+        if (strncmp(field, "input=", 6) == 0 && field[6])
+        {
+            free(o_job->input);
+            o_job->input = copyString(field + 6);
+            return true;
+        }
+
+        if (strncmp(field, "engine=", 7) == 0)
+        {
+            return parseEngine(field + 7, &o_job->engine);
+        }
+
+        if (strncmp(field, "quirks=", 7) == 0)
+        {
+            return parseQuirks(field + 7, &o_job->quirks);
+        }
+
+        return false;
+    }
+
+    static void addJob(JobList* list, const Job& job)
+    {
+        if (list->count == list->capacity)
+        {
+            list->capacity = (list->capacity ? list->capacity * 2 : 64);
+            list->jobs     = (Job*)realloc(list->jobs, list->capacity * sizeof(Job));
+        }
+
+        list->jobs[list->count++] = job;
+    }
+
+    static void freeJobs(JobList* list)
+    {
+        for (uint32_t i = 0; i < list->count; ++i)
+        {
+            free(list->jobs[i].rom);
+            free(list->jobs[i].input);
+        }
+
+        free(list->jobs);
+        *list = JobList{};
+    }
+
+    static bool loadJobs(const char* path, JobList* o_list)
+    {
+        FILE* file = (strcmp(path, "-") == 0 ? stdin : fopen(path, "r"));
+
+        if (!file)
+        {
+            fprintf(stderr, "ERROR: Failed to open %s.\n", path);
+            return false;
+        }
+
+        char     line[MAX_LINE];
+        uint32_t lineNum = 0;
+        bool     success = true;
+
+        while (success && fgets(line, sizeof(line), file))
+        {
+            ++lineNum;
+
+            Job job{};
+            job.hz = DEFAULT_CYCLE_HZ;
+
+            for (char* field = line; success; )
+            {
+                field += strspn(field, " \t\r\n");
+
+                if (!*field || (*field == '#' && !job.rom))
+                {
+                    break;
+                }
+
+                char* end = field + strcspn(field, " \t\r\n");
+                const bool last = !*end;
+                *end = '\0';
+
+                if (!job.rom)
+                {
+                    job.rom = copyString(field);
+                }
+                else if (!parseJobField(field, &job))
+                {
+                    fprintf(stderr, "ERROR: Invalid field %s on line %u of %s.\n", field, lineNum, path);
+                    success = false;
+                }
+
+                field = (last ? end : end + 1);
+            }
+
+            if (success && job.rom)
+            {
+                addJob(o_list, job);
+            }
+            else
+            {
+                free(job.rom);
+                free(job.input);
+            }
+        }
+
+        if (file != stdin)
+        {
+            fclose(file);
+        }
+
+        return success;
+    }
+
+    static uint64_t hashFb(const System::Fb& fb)
+    {
+        // FNV-1a, as systemHash.
+        uint64_t      hash  = 0xCBF29CE484222325ull;
+        const uint8_t* bytes = (const uint8_t*)fb;
+
+        for (size_t i = 0; i < sizeof(fb); ++i)
+        {
+            hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+
+    static size_t appendf(char* buf, size_t size, size_t len, const char* format, ...)
+    {
+        if (len >= size)
+        {
+            return len;
+        }
+
+        va_list args;
+        va_start(args, format);
+        const int32_t written = vsnprintf(buf + len, size - len, format, args);
+        va_end(args);
+
+        return len + (written > 0 ? size_t(written) : 0);
+    }
+
+    static size_t appendString(char* buf, size_t size, size_t len, const char* str)
+    {
+        len = appendf(buf, size, len, "\"");
+
+        for (const char* ch = str; *ch; ++ch)
+        {
+            if (*ch == '"' || *ch == '\\')
+            {
+                len = appendf(buf, size, len, "\\%c", *ch);
+            }
+            else if (uint8_t(*ch) < 0x20)
+            {
+                len = appendf(buf, size, len, "\\u%04x", unsigned(uint8_t(*ch)));
+            }
+            else
+            {
+                len = appendf(buf, size, len, "%c", *ch);
+            }
+        }
+
+        return appendf(buf, size, len, "\"");
+    }
+
+    // Runs one job on the worker's system, and writes its result.
+    static void runJob(Batch* batch, Worker* worker, uint32_t index)
+    {
+        const Job& job = batch->list->jobs[index];
+        System*    sys = worker->sys;
+
+        void*    programBuf;
+        uint16_t programMaxSize;
+
+        systemInit(sys);
+        systemSeed(sys, job.seed);
+        systemProgramMem(sys, &programBuf, &programMaxSize);
+        sys->cycleHz  = job.hz;
+        sys->muted    = true;
+        sys->stopIdle = batch->args->skipIdle;
+
+        const char* error = nullptr;
+        FILE*       input = nullptr;
+        RunExit     exit  = RUN_BUDGET;
+
+        if (!runnerLoadFile(job.rom, programBuf, programMaxSize))
+        {
+            error = "Failed to load ROM.";
+        }
+        else if (!systemSetEngine(sys, job.engine))
+        {
+            error = "Engine not supported by this build, or for this ROM.";
+        }
+        else if (!systemSetQuirks(sys, job.quirks))
+        {
+            error = "Quirks not supported by the engine.";
+        }
+        else if (job.input && !(input = fopen(job.input, "r")))
+        {
+            error = "Failed to open input.";
+        }
+        else
+        {
+            const uint64_t cycles = (job.frames ? job.frames * job.hz / 60 : job.cycles ? job.cycles : batch->args->cycles);
+            runnerRun(sys, cycles, input, batch->ring, index, &exit);
+        }
+
+        if (input)
+        {
+            fclose(input);
+        }
+
+        char   line[MAX_LINE];
+        size_t len = 0;
+
+        len = appendf(line, sizeof(line), len, "{\"job\":%u,\"rom\":", index);
+        len = appendString(line, sizeof(line), len, job.rom);
+
+        if (error)
+        {
+            len = appendf(line, sizeof(line), len, ",\"error\":");
+            len = appendString(line, sizeof(line), len, error);
+            batch->numFailed.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            len = appendf(line, sizeof(line), len, ",\"exit\":\"%s\",\"cycles\":%llu,\"pc\":%u,\"I\":%u,\"sp\":%d,\"V\":[",
+                runnerExitName(exit), (unsigned long long)sys->cycles, sys->pc, sys->I, sys->sp);
+
+            for (uint32_t i = 0; i < 16; ++i)
+            {
+                len = appendf(line, sizeof(line), len, i ? ",%u" : "%u", sys->V[i]);
+            }
+
+            // As strings, since JSON readers tend to lose the low bits of
+            // numbers this large.
+            len = appendf(line, sizeof(line), len, "],\"fb_hash\":\"%016llx\",\"hash\":\"%016llx\"",
+                (unsigned long long)hashFb(sys->fb), (unsigned long long)systemHash(sys));
+        }
+
+        len = appendf(line, sizeof(line), len, "}\n");
+        systemShutdown(sys);
+
+        // A line that didn't fit would be cut short, and not be valid JSON,
+        // but only a ROM path about as long as the line could do that.
+        len = (len < sizeof(line) ? len : sizeof(line) - 1);
+
+        std::lock_guard<std::mutex> lock(batch->outMutex);
+        fwrite(line, 1, len, stdout);
+        fflush(stdout);
+    }
+
+    static uint64_t packRange(uint32_t begin, uint32_t end)
+    {
+        return (uint64_t(end) << 32) | begin;
+    }
+
+    // Takes the job at the front of the worker's own range.
+    static bool takeJob(Worker* worker, uint32_t* o_index)
+    {
+        uint64_t range = worker->range.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            const uint32_t begin = uint32_t(range);
+            const uint32_t end   = uint32_t(range >> 32);
+
+            if (begin >= end)
+            {
+                return false;
+            }
+
+            if (worker->range.compare_exchange_weak(range, packRange(begin + 1, end), std::memory_order_acq_rel))
+            {
+                *o_index = begin;
+                return true;
+            }
+        }
+    }
+
+    // Steals the back half of `victim`'s range, returning the first job of
+    // it and keeping the rest as the thief's own range, which is empty.
+    static bool stealJobs(Worker* thief, Worker* victim, uint32_t* o_index)
+    {
+        uint64_t range = victim->range.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            const uint32_t begin = uint32_t(range);
+            const uint32_t end   = uint32_t(range >> 32);
+
+            if (begin >= end)
+            {
+                return false;
+            }
+
+            const uint32_t split = end - (end - begin + 1) / 2;
+
+            if (victim->range.compare_exchange_weak(range, packRange(begin, split), std::memory_order_acq_rel))
+            {
+                thief->range.store(packRange(split + 1, end), std::memory_order_release);
+                *o_index = split;
+                return true;
+            }
+        }
+    }
+
+    static void work(Batch* batch, uint32_t self)
+    {
+        Worker* worker = &batch->workers[self];
+
+        for (;;)
+        {
+            uint32_t index;
+
+            if (!takeJob(worker, &index))
+            {
+                // No new jobs are ever added, so one pass over the others
+                // finding nothing means we're done. Jobs another thief is
+                // moving into its range when we look are run by that thief.
+                bool stolen = false;
+
+                for (uint32_t i = 1; i < batch->numWorkers && !stolen; ++i)
+                {
+                    stolen = stealJobs(worker, &batch->workers[(self + i) % batch->numWorkers], &index);
+                }
+
+                if (!stolen)
+                {
+                    return;
+                }
+
+                ++worker->numStolen;
+            }
+
+            runJob(batch, worker, index);
+            ++worker->numRun;
+        }
+    }
+
+} // namespace c8e
+
+int main(int argc, char** argv)
+{
+    c8e::Args args;
+
+    if (!c8e::parseArgs(&args, argc, argv))
+    {
+        return 1;
+    }
+
+    if (args.help || !args.path)
+    {
+        c8e::showUsage(argv[0]);
+        return args.help ? 0 : 1;
+    }
+
+    c8e::JobList list{};
+
+    if (!c8e::loadJobs(args.path, &list))
+    {
+        c8e::freeJobs(&list);
+        return 1;
+    }
+
+    uint32_t numWorkers = args.threads;
+
+    if (!numWorkers)
+    {
+        const uint32_t cores = std::thread::hardware_concurrency();
+        numWorkers = (cores ? (cores < c8e::MAX_THREADS ? cores : c8e::MAX_THREADS) : 1);
+    }
+
+    numWorkers = (numWorkers < list.count ? numWorkers : (list.count ? list.count : 1));
+
+    c8e::Ring ring{};
+
+    if (args.ring && !c8e::ringCreate(&ring, args.ring, c8e::RING_DEFAULT_SLOTS))
+    {
+        fprintf(stderr, "ERROR: Failed to create ring %s.\n", args.ring);
+        c8e::freeJobs(&list);
+        return 1;
+    }
+
+    c8e::Batch batch;
+    batch.args       = &args;
+    batch.list       = &list;
+    batch.numWorkers = numWorkers;
+    batch.ring       = (args.ring ? &ring : nullptr);
+    batch.numFailed  = 0;
+
+    // Deal the jobs out evenly to start with. Stealing evens it out again
+    // when some jobs run for longer than others.
+    for (uint32_t i = 0; i < numWorkers; ++i)
+    {
+        const uint32_t begin = uint32_t(uint64_t(list.count) * i / numWorkers);
+        const uint32_t end   = uint32_t(uint64_t(list.count) * (i + 1) / numWorkers);
+
+        batch.workers[i].range     = c8e::packRange(begin, end);
+        batch.workers[i].sys       = new c8e::System;
+        batch.workers[i].numRun    = 0;
+        batch.workers[i].numStolen = 0;
+    }
+
+    for (uint32_t i = 1; i < numWorkers; ++i)
+    {
+        batch.workers[i].thread = std::thread(c8e::work, &batch, i);
+    }
+
+    c8e::work(&batch, 0);
+
+    for (uint32_t i = 0; i < numWorkers; ++i)
+    {
+        if (batch.workers[i].thread.joinable())
+        {
+            batch.workers[i].thread.join();
+        }
+
+        delete batch.workers[i].sys;
+    }
+
+    c8e::ringClose(&ring);
+
+    const uint32_t numFailed = batch.numFailed.load();
+    c8e::freeJobs(&list);
+
+    if (numFailed)
+    {
+        fprintf(stderr, "ERROR: %u jobs failed.\n", numFailed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,392 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "../compat/time.hpp"
+
+#include "../expand.hpp"
+#include "../lockstep.hpp"
+#include "../system.hpp"
+#include "../vecenv.hpp"
+
+namespace c8e
+{
+
+    static constexpr uint32_t NUM_ROWS = 32 * 256; // Rows of 256 framebuffers.
+    static constexpr uint32_t ROUNDS   = 200;
+    static constexpr uint32_t FG       = 0xFF40C0E0;
+    static constexpr uint32_t BG       = 0xFF201008;
+
+    struct Kernel
+    {
+        const char*  name;
+        ExpandKernel kernel;
+    };
+
+    static const Kernel KERNELS[] =
+    {
+        {"scalar", EXPAND_SCALAR},
+        {"sse2",   EXPAND_SSE2},
+        {"avx2",   EXPAND_AVX2},
+    };
+
+    struct EngineInfo
+    {
+        const char* name;
+        Engine      engine;
+    };
+
+    static const EngineInfo ENGINES[] =
+    {
+        {"switch",   ENGINE_SWITCH},
+        {"table",    ENGINE_TABLE},
+        {"threaded", ENGINE_THREADED},
+        {"fused",    ENGINE_FUSED},
+        {"jit",      ENGINE_JIT},
+        {"aot",      ENGINE_AOT},
+    };
+
+    static constexpr uint32_t ENGINE_FRAMES = 60 * 60 * 30; // Half an hour of play, with no keys pressed.
+    static constexpr uint32_t FRAMES        = 600;
+    static constexpr uint32_t FRAME_CYCLES = DEFAULT_CYCLE_HZ / 60;
+    static constexpr uint32_t NUM_ENVS     = 8 * LOCKSTEP_LANES;
+
+    static uint64_t timeNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+    }
+
+    static void fillRows(uint64_t* rows, uint32_t numRows)
+    {
+        // Mostly sparse rows, with some empty and some full, like screens.
+        uint64_t x = 0x9E3779B97F4A7C15;
+
+        for (uint32_t i = 0; i < numRows; ++i)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+
+            switch (i % 8)
+            {
+                case 0:  rows[i] = 0; break;
+                case 1:  rows[i] = UINT64_MAX; break;
+                default: rows[i] = x & (x >> 3); break;
+            }
+        }
+    }
+
+    // Returns false if the kernel isn't supported, or disagrees with `expected`.
+    static bool bench(const Kernel& kernel, const uint64_t* rows, const uint32_t* expected, uint32_t* pixels)
+    {
+        const ExpandFn fn = expandFn(kernel.kernel);
+
+        if (!fn)
+        {
+            printf("%-8s not supported\n", kernel.name);
+            return true;
+        }
+
+        fn(rows, NUM_ROWS, FG, BG, pixels);
+
+        if (memcmp(pixels, expected, NUM_ROWS * 64 * sizeof(uint32_t)) != 0)
+        {
+            printf("%-8s MISMATCH\n", kernel.name);
+            return false;
+        }
+
+        const uint64_t start = timeNs();
+
+        for (uint32_t i = 0; i < ROUNDS; ++i)
+        {
+            fn(rows, NUM_ROWS, FG, BG, pixels);
+        }
+
+        const double ns  = double(timeNs() - start);
+        const double fbs = double(ROUNDS) * NUM_ROWS / 32;
+
+        printf("%-8s %8.1f ns per framebuffer, %8.1f Mpixels/s\n", kernel.name, ns / fbs,
+            double(ROUNDS) * NUM_ROWS * 64 / ns * 1000.0);
+        return true;
+    }
+
+    // The keys lane `lane` holds during `frame`: now and then one of its own,
+    // so that the lanes part ways as players' inputs would make them.
+    static uint16_t laneKeys(uint32_t lane, uint32_t frame)
+    {
+        return uint16_t(((frame / 10 + lane) % 5 == 0) ? 1 << ((frame / 10 + lane) % 16) : 0);
+    }
+
+    static void initInstances(System* systems, Lockstep* ls, const uint8_t* rom, uint16_t romSize, bool sameKeys)
+    {
+        lockstepInit(ls, LOCKSTEP_LANES);
+        lockstepLoad(ls, rom, romSize);
+
+        for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+        {
+            void*    programBuf;
+            uint16_t programMaxSize;
+
+            systemShutdown(&systems[l]);
+            systemInit(&systems[l]);
+            systemProgramMem(&systems[l], &programBuf, &programMaxSize);
+            memcpy(programBuf, rom, romSize);
+            systems[l].muted = true;
+
+            // The same seed for all, as copies of one game differing only in
+            // input would have.
+            ls->keys[l] = systems[l].keys = (sameKeys ? 0 : laneKeys(l, 0));
+        }
+    }
+
+    // Runs the ROM on LOCKSTEP_LANES systems, one after another a frame at a
+    // time, and on as many lanes in lockstep. Returns false if they disagree.
+    static bool benchLockstep(const uint8_t* rom, uint16_t romSize, bool sameKeys)
+    {
+        static System   systems[LOCKSTEP_LANES];
+        static Lockstep ls;
+
+        initInstances(systems, &ls, rom, romSize, sameKeys);
+        uint64_t start = timeNs();
+
+        for (uint32_t frame = 0; frame < FRAMES; ++frame)
+        {
+            for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+            {
+                System*        sys = &systems[l];
+                const uint64_t end = sys->cycles + FRAME_CYCLES;
+                sys->keys = (sameKeys ? 0 : laneKeys(l, frame));
+
+                while (sys->cycles < end)
+                {
+                    RunResult result;
+                    systemRun(sys, end - sys->cycles, &result);
+
+                    if (result.exit == RUN_UNKNOWN_OP || result.exit == RUN_STACK_FAULT)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        const uint64_t switchNs = timeNs() - start;
+        start = timeNs();
+
+        for (uint32_t frame = 0; frame < FRAMES; ++frame)
+        {
+            for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+            {
+                ls.keys[l] = (sameKeys ? 0 : laneKeys(l, frame));
+            }
+
+            lockstepRun(&ls, FRAME_CYCLES);
+        }
+
+        const uint64_t lockstepNs = timeNs() - start;
+
+        for (uint32_t l = 0; l < LOCKSTEP_LANES; ++l)
+        {
+            static System      lane;
+            static SystemState state;
+
+            lockstepSave(&ls, l, &state);
+            systemInit(&lane);
+            systemRestore(&lane, &state);
+
+            if (systemHash(&lane) != systemHash(&systems[l]))
+            {
+                printf("%-16s MISMATCH in lane %u\n", sameKeys ? "same keys" : "different keys", l);
+                return false;
+            }
+        }
+
+        const double ops = double(FRAMES) * FRAME_CYCLES * LOCKSTEP_LANES;
+
+        printf("%-16s switch %6.1f ns, lockstep %6.1f ns per instruction, %5.2f groups per step\n",
+            sameKeys ? "same keys" : "different keys", double(switchNs) / ops, double(lockstepNs) / ops,
+            double(ls.numGroups) / (double(FRAMES) * FRAME_CYCLES));
+        return true;
+    }
+
+    // Runs a system with `engine` for ENGINE_FRAMES frames, `frames` at a
+    // time, and returns the ns it took. Returns zero if the engine isn't
+    // supported.
+    static uint64_t timeEngine(System* sys, Engine engine, const uint8_t* rom, uint16_t romSize, uint32_t frames)
+    {
+        void*    programBuf;
+        uint16_t programMaxSize;
+
+        systemShutdown(sys);
+        systemInit(sys);
+        systemProgramMem(sys, &programBuf, &programMaxSize);
+        memcpy(programBuf, rom, romSize);
+        sys->muted = true;
+
+        if (!systemSetEngine(sys, engine))
+        {
+            return 0;
+        }
+
+        const uint64_t start = timeNs();
+
+        for (uint32_t frame = 0; frame < ENGINE_FRAMES; frame += frames)
+        {
+            const uint64_t end = sys->cycles + uint64_t(FRAME_CYCLES) * frames;
+
+            while (sys->cycles < end)
+            {
+                RunResult result;
+                systemRun(sys, end - sys->cycles, &result);
+
+                if (result.exit == RUN_UNKNOWN_OP || result.exit == RUN_STACK_FAULT)
+                {
+                    return timeNs() - start;
+                }
+            }
+        }
+
+        return timeNs() - start;
+    }
+
+    // Times each engine on the ROM, a frame at a time as the frontend runs
+    // it, and in runs of many frames. Returns false if an engine ends in a
+    // different state than the switch engine does.
+    static bool benchEngines(const uint8_t* rom, uint16_t romSize)
+    {
+        static constexpr uint32_t LONG_FRAMES = 600;
+        static System             sys;
+
+        uint64_t expected = 0;
+
+        for (const EngineInfo& info : ENGINES)
+        {
+            const uint64_t frameNs = timeEngine(&sys, info.engine, rom, romSize, 1);
+
+            if (!frameNs)
+            {
+                printf("%-16s not supported\n", info.name);
+                continue;
+            }
+
+            const uint64_t frameHash = systemHash(&sys);
+            const double   ops       = double(sys.cycles);
+            const uint64_t longNs    = timeEngine(&sys, info.engine, rom, romSize, LONG_FRAMES);
+            const uint64_t longHash  = systemHash(&sys);
+
+            if (info.engine == ENGINE_SWITCH)
+            {
+                expected = frameHash;
+            }
+
+            if (frameHash != expected || longHash != expected)
+            {
+                printf("%-16s MISMATCH\n", info.name);
+                return false;
+            }
+
+            printf("%-16s %6.1f ns per instruction a frame at a time, %6.1f ns in runs of %u frames\n",
+                info.name, double(frameNs) / ops, double(longNs) / ops, LONG_FRAMES);
+        }
+
+        systemShutdown(&sys);
+        return true;
+    }
+
+    // Steps NUM_ENVS envs of the ROM a frame at a time, with observations of
+    // a byte per pixel, as an agent being trained on it would.
+    static bool benchVecEnv(const uint8_t* rom, uint16_t romSize)
+    {
+        static uint8_t  obs[NUM_ENVS * 64 * 32];
+        static uint32_t seeds[NUM_ENVS];
+        static uint16_t actions[NUM_ENVS];
+        static float    rewards[NUM_ENVS];
+        static bool     dones[NUM_ENVS];
+
+        VecEnv env;
+
+        if (!vecEnvInit(&env, NUM_ENVS, rom, romSize))
+        {
+            printf("%-16s FAILED to init\n", "envs");
+            return false;
+        }
+
+        env.obs       = obs;
+        env.obsFormat = OBS_BYTES;
+
+        for (uint32_t i = 0; i < NUM_ENVS; ++i)
+        {
+            seeds[i] = i + 1;
+        }
+
+        vecEnvReset(&env, seeds);
+        const uint64_t start = timeNs();
+
+        for (uint32_t frame = 0; frame < FRAMES; ++frame)
+        {
+            for (uint32_t i = 0; i < NUM_ENVS; ++i)
+            {
+                actions[i] = laneKeys(i, frame);
+            }
+
+            vecEnvStep(&env, actions, rewards, dones);
+        }
+
+        const uint64_t ns = timeNs() - start;
+        vecEnvShutdown(&env);
+
+        printf("%-16s %u envs, %6.1f ns per env step\n", "envs", NUM_ENVS, double(ns) / (double(FRAMES) * NUM_ENVS));
+        return true;
+    }
+
+} // namespace c8e
+
+int main(int argc, char** argv)
+{
+    static uint64_t rows[c8e::NUM_ROWS];
+    static uint32_t expected[c8e::NUM_ROWS * 64];
+    static uint32_t pixels[c8e::NUM_ROWS * 64];
+
+    c8e::fillRows(rows, c8e::NUM_ROWS);
+    c8e::expandFn(c8e::EXPAND_SCALAR)(rows, c8e::NUM_ROWS, c8e::FG, c8e::BG, expected);
+
+    printf("Expanding 1bpp framebuffers to RGBA:\n");
+    bool ok = true;
+
+    for (const c8e::Kernel& kernel : c8e::KERNELS)
+    {
+        ok = c8e::bench(kernel, rows, expected, pixels) && ok;
+    }
+
+    if (argc > 1)
+    {
+        static uint8_t rom[4096 - 0x200];
+        FILE*          file = fopen(argv[1], "rb");
+
+        if (!file)
+        {
+            fprintf(stderr, "ERROR: Failed to open %s.\n", argv[1]);
+            return 1;
+        }
+
+        const uint16_t romSize = uint16_t(fread(rom, 1, sizeof(rom), file));
+        fclose(file);
+
+        printf("\nRunning %s for %u frames on each engine:\n", argv[1], c8e::ENGINE_FRAMES);
+        ok = c8e::benchEngines(rom, romSize) && ok;
+
+        printf("\nRunning %u instances of %s for %u frames:\n", c8e::LOCKSTEP_LANES, argv[1], c8e::FRAMES);
+        ok = c8e::benchLockstep(rom, romSize, true) && ok;
+        ok = c8e::benchLockstep(rom, romSize, false) && ok;
+        ok = c8e::benchVecEnv(rom, romSize) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
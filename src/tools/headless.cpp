@@ -0,0 +1,277 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../parse.hpp"
+#include "../ring.hpp"
+#include "../runner.hpp"
+#include "../system.hpp"
+
+namespace c8e
+{
+
+    struct Args
+    {
+        bool        help{false};
+        uint64_t    cycles{0};
+        uint64_t    frames{60};
+        uint32_t    hz{DEFAULT_CYCLE_HZ};
+        uint32_t    seed{0};
+        Engine      engine{ENGINE_SWITCH};
+        uint8_t     quirks{0};
+        bool        skipIdle{false};
+        const char* input{nullptr};
+        const char* pbm{nullptr};
+        const char* ring{nullptr};
+        const char* path{nullptr};
+    };
+
+    static void showUsage(const char* prg)
+    {
+        const char* basename = runnerBasename(prg);
+
+        printf("%s: Runs a CHIP-8 ROM without a window, and prints a hash of the state it ends in.\n", basename);
+        printf("\n");
+        printf("Usage:\n");
+        printf("\n");
+        printf("  %s --help\n", basename);
+        printf("  %s [--cycles=<n> | --frames=<n>] [--hz=<n>] [--seed=<n>] [--input=<path>] [--pbm=<path>]\n", basename);
+        printf("  %*s [--ring=<name>] [--engine=<name>] [--quirks=<names>] [--skip-idle] <c8_path>\n", int(strlen(basename)), "");
+        printf("\n");
+        printf("Arguments:\n");
+        printf("\n");
+        printf("  --help\tShow this help and exit.\n");
+        printf("  --cycles\tInstructions to run.\n");
+        printf("  --frames\tFrames to run, at 60 per second (default 60).\n");
+        printf("  --hz  \tInstructions per second (default %u), which sets how fast the timers run.\n", unsigned(DEFAULT_CYCLE_HZ));
+        printf("  --seed\tSeed for CXNN's random numbers.\n");
+        printf("  --input\tKeys to press, as lines of the cycle and the keys held in hex, like c8e --record writes.\n");
+        printf("  --pbm\tWrite the final framebuffer to a PBM image.\n");
+        printf("  --ring\tPublish every frame to a ring in POSIX shared memory by this name, like /c8e.\n");
+        printf("  --engine\tInterpreter to run the CPU with: switch (default), threaded, jit, aot, fused or table.\n");
+        printf("  --quirks\tComma separated CHIP-8 variant behaviors the ROM expects, as for c8e.\n");
+        printf("  --skip-idle\tSkip ahead to the next timer tick when the ROM idles until it. Changes the hash.\n");
+        printf("  c8_path\tPath to the CHIP-8 ROM to run.\n");
+        printf("\n");
+    }
+
+    static bool parseArgs(Args* args, int32_t argc, char** argv)
+    {
+        for (int32_t i = 1; i < argc; ++i)
+        {
+            uint64_t value;
+
+            if (strcmp(argv[i], "--help") == 0)
+            {
+                args->help = true;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--cycles=", 9) == 0 && runnerParseNumber(argv[i] + 9, &value))
+            {
+                args->cycles = value;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--frames=", 9) == 0 && runnerParseNumber(argv[i] + 9, &value))
+            {
+                args->frames = value;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--hz=", 5) == 0 && runnerParseNumber(argv[i] + 5, &value) && value && value <= (UINT32_MAX >> 1))
+            {
+                args->hz = uint32_t(value);
+                continue;
+            }
+
+            if (strncmp(argv[i], "--seed=", 7) == 0 && runnerParseNumber(argv[i] + 7, &value) && value <= UINT32_MAX)
+            {
+                args->seed = uint32_t(value);
+                continue;
+            }
+
+            if (strncmp(argv[i], "--input=", 8) == 0)
+            {
+                args->input = argv[i] + 8;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--pbm=", 6) == 0)
+            {
+                args->pbm = argv[i] + 6;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--ring=", 7) == 0)
+            {
+                args->ring = argv[i] + 7;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--engine=", 9) == 0)
+            {
+                if (!parseEngine(argv[i] + 9, &args->engine))
+                {
+                    fprintf(stderr, "ERROR: Unknown engine %s.\n", argv[i] + 9);
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (strncmp(argv[i], "--quirks=", 9) == 0)
+            {
+                if (!parseQuirks(argv[i] + 9, &args->quirks))
+                {
+                    fprintf(stderr, "ERROR: Unknown quirks %s.\n", argv[i] + 9);
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (strcmp(argv[i], "--skip-idle") == 0)
+            {
+                args->skipIdle = true;
+                continue;
+            }
+
+            if (strncmp(argv[i], "--", 2) == 0)
+            {
+                fprintf(stderr, "ERROR: Invalid argument %s.\n", argv[i]);
+                return false;
+            }
+
+            if (!args->path)
+            {
+                args->path = argv[i];
+            }
+        }
+
+        return true;
+    }
+
+    // Writes the framebuffer as a binary PBM, which has the same layout: one
+    // bit per pixel, leftmost in the most significant bit, set if on.
+    static bool writePbm(const char* path, const System::Fb& fb)
+    {
+        FILE* file = fopen(path, "wb");
+
+        if (!file)
+        {
+            return false;
+        }
+
+        fprintf(file, "P4\n64 %u\n", unsigned(sizeof(fb) / sizeof(fb[0])));
+
+        for (uint64_t row : fb)
+        {
+            for (int32_t shift = 56; shift >= 0; shift -= 8)
+            {
+                fputc(int((row >> shift) & 0xFF), file);
+            }
+        }
+
+        return fclose(file) == 0;
+    }
+
+} // namespace c8e
+
+int main(int argc, char** argv)
+{
+    c8e::Args args;
+
+    if (!c8e::parseArgs(&args, argc, argv))
+    {
+        return 1;
+    }
+
+    if (args.help || !args.path)
+    {
+        c8e::showUsage(argv[0]);
+        return args.help ? 0 : 1;
+    }
+
+    void*    programBuf;
+    uint16_t programMaxSize;
+
+    static c8e::System sys;
+    c8e::systemInit(&sys);
+    c8e::systemSeed(&sys, args.seed);
+    c8e::systemProgramMem(&sys, &programBuf, &programMaxSize);
+    sys.cycleHz  = args.hz;
+    sys.muted    = true;
+    sys.stopIdle = args.skipIdle;
+
+    if (!c8e::runnerLoadFile(args.path, programBuf, programMaxSize))
+    {
+        fprintf(stderr, "ERROR: Failed to load ROM %s.\n", args.path);
+        return 1;
+    }
+
+    if (!c8e::systemSetEngine(&sys, args.engine))
+    {
+        fprintf(stderr, "ERROR: Engine not supported by this build, or for this ROM.\n");
+        return 1;
+    }
+
+    if (!c8e::systemSetQuirks(&sys, args.quirks))
+    {
+        fprintf(stderr, "ERROR: Quirks not supported by the engine.\n");
+        return 1;
+    }
+
+    c8e::Ring ring{};
+
+    if (args.ring && !c8e::ringCreate(&ring, args.ring, c8e::RING_DEFAULT_SLOTS))
+    {
+        fprintf(stderr, "ERROR: Failed to create ring %s.\n", args.ring);
+        return 1;
+    }
+
+    FILE* input = nullptr;
+
+    if (args.input && !(input = fopen(args.input, "r")))
+    {
+        fprintf(stderr, "ERROR: Failed to open %s.\n", args.input);
+        return 1;
+    }
+
+    // Nothing depends on the host's clock, so the same arguments always
+    // end in the same state.
+    const uint64_t cycles = (args.cycles ? args.cycles : args.frames * args.hz / 60);
+
+    c8e::RunExit exit;
+    const bool   ok = c8e::runnerRun(&sys, cycles, input, args.ring ? &ring : nullptr, 0, &exit);
+
+    if (input)
+    {
+        fclose(input);
+    }
+
+    c8e::ringClose(&ring);
+
+    if (!ok)
+    {
+        fprintf(stderr, "ERROR: %s at 0x%03X.\n", exit == c8e::RUN_UNKNOWN_OP ? "Unknown op code" : "Stack fault", sys.pc);
+    }
+
+    printf("cycles=%llu pc=%03X exit=%s hash=%016llx\n", (unsigned long long)sys.cycles, sys.pc,
+        c8e::runnerExitName(exit), (unsigned long long)c8e::systemHash(&sys));
+
+    if (args.pbm && !c8e::writePbm(args.pbm, sys.fb))
+    {
+        fprintf(stderr, "ERROR: Failed to write %s.\n", args.pbm);
+        return 1;
+    }
+
+    c8e::systemShutdown(&sys);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,55 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include "triplebuf.hpp"
+
+#include <cstring>
+
+namespace c8e
+{
+
+    static constexpr uint8_t INDEX_MASK = 0x3;
+    static constexpr uint8_t FRESH      = 0x4;
+
+    void tripleBufferInit(TripleBuffer* tb)
+    {
+        memset(tb->bufs, 0, sizeof(tb->bufs));
+        memset(tb->dirty, 0, sizeof(tb->dirty));
+        tb->back  = 0;
+        tb->middle.store(1, std::memory_order_relaxed);
+        tb->front = 2;
+    }
+
+    void tripleBufferPublish(TripleBuffer* tb, const System::Fb& fb, uint32_t dirty)
+    {
+        // If the reader hasn't taken the buffer this replaces, it never will,
+        // so it needs this one to carry its changes along. Should the reader
+        // take it in the meantime, this only ends up with rows to spare.
+        const uint8_t middle = tb->middle.load(std::memory_order_acquire);
+        const uint32_t carry = (middle & FRESH ? tb->dirty[middle & INDEX_MASK] : 0);
+
+        memcpy(tb->bufs[tb->back], fb, sizeof(System::Fb));
+        tb->dirty[tb->back] = dirty | carry;
+
+        // Release the writes above to the reader, and take the buffer it may
+        // have just given up.
+        const uint8_t old = tb->middle.exchange(tb->back | FRESH, std::memory_order_acq_rel);
+        tb->back = old & INDEX_MASK;
+    }
+
+    const System::Fb* tripleBufferAcquire(TripleBuffer* tb, uint32_t* o_dirty)
+    {
+        if (!(tb->middle.load(std::memory_order_relaxed) & FRESH))
+        {
+            return nullptr;
+        }
+
+        const uint8_t latest = tb->middle.exchange(tb->front, std::memory_order_acq_rel);
+        tb->front = latest & INDEX_MASK;
+        *o_dirty  = tb->dirty[tb->front];
+        return &tb->bufs[tb->front];
+    }
+
+} // namespace c8e
@@ -0,0 +1,40 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "system.hpp"
+
+namespace c8e
+{
+
+    // Hands framebuffers from one writer thread to one reader thread without
+    // either ever waiting on the other. The writer fills the back buffer and
+    // swaps it with the middle one; the reader swaps the middle one with the
+    // front buffer when a new one was published, so it always gets the latest.
+    struct TripleBuffer
+    {
+        System::Fb           bufs[3];
+        uint32_t             dirty[3]; // Rows that changed since the buffer published before.
+        std::atomic<uint8_t> middle; // Index, and FRESH if not yet read.
+        uint8_t              back;   // Only touched by the writer.
+        uint8_t              front;  // Only touched by the reader.
+    };
+
+    void tripleBufferInit(TripleBuffer* tb);
+
+    // Copies `fb` into the back buffer, and makes it the latest. `dirty` has
+    // the rows that changed since the last one published.
+    void tripleBufferPublish(TripleBuffer* tb, const System::Fb& fb, uint32_t dirty);
+
+    // Returns the latest framebuffer published, or nullptr if the last one
+    // returned still is. It stays valid until the next call. `o_dirty` gets
+    // the rows that changed since the last one returned.
+    const System::Fb* tripleBufferAcquire(TripleBuffer* tb, uint32_t* o_dirty);
+
+} // namespace c8e
@@ -0,0 +1,195 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#include <cstdlib>
+#include <cstring>
+
+#include "vecenv.hpp"
+
+namespace c8e
+{
+
+    static constexpr uint32_t FB_WIDTH  = 64;
+    static constexpr uint32_t FB_HEIGHT = 32;
+
+    static void writeRow(ObsFormat format, uint64_t row, uint32_t y, uint8_t* o_obs)
+    {
+        if (format == OBS_PACKED)
+        {
+            memcpy(o_obs + y * sizeof(row), &row, sizeof(row));
+            return;
+        }
+
+        uint8_t* pixels = o_obs + y * FB_WIDTH;
+
+        for (uint32_t x = 0; x < FB_WIDTH; ++x)
+        {
+            pixels[x] = uint8_t((row >> (FB_WIDTH - 1 - x)) & 1);
+        }
+    }
+
+    // Writes the rows of the lane's framebuffer that changed since it was
+    // last written, or all of them if `all`.
+    static void writeObs(VecEnv* env, Lockstep* ls, uint32_t lane, bool all, uint8_t* o_obs)
+    {
+        uint32_t dirty = (all ? ~0u : ls->fbDirty[lane]);
+        ls->fbDirty[lane] = 0;
+
+        for (uint32_t y = 0; dirty; ++y, dirty >>= 1)
+        {
+            if (dirty & 1)
+            {
+                writeRow(env->obsFormat, ls->fb[lane][y], y, o_obs);
+            }
+        }
+    }
+
+    // The cycle the lane's next timer tick, and so its next frame, starts at.
+    // Running to it rather than a fixed number of cycles keeps frames in line
+    // with the timers, at rates that aren't a multiple of 60.
+    static uint64_t nextFrame(const Lockstep* ls, uint32_t lane)
+    {
+        const uint64_t tick = ls->cycles[lane] * 60 / ls->cycleHz;
+        return ((tick + 1) * ls->cycleHz + 59) / 60;
+    }
+
+    static void startEpisode(VecEnv* env, Lockstep* ls, uint32_t lane, uint32_t seed)
+    {
+        lockstepRestore(ls, lane, env->start);
+        lockstepSeed(ls, lane, seed);
+    }
+
+    uint32_t vecEnvObsSize(ObsFormat format)
+    {
+        return (format == OBS_PACKED ? sizeof(System::Fb) : FB_WIDTH * FB_HEIGHT);
+    }
+
+    bool vecEnvInit(VecEnv* env, uint32_t numEnvs, const void* rom, uint16_t romSize)
+    {
+        memset(env, 0, sizeof(*env));
+        env->numEnvs       = numEnvs;
+        env->numBlocks     = (numEnvs + LOCKSTEP_LANES - 1) / LOCKSTEP_LANES;
+        env->framesPerStep = 1;
+        env->cycleHz       = DEFAULT_CYCLE_HZ;
+
+        env->blocks = static_cast<Lockstep*>(malloc(env->numBlocks * sizeof(Lockstep)));
+        env->frames = static_cast<uint32_t*>(calloc(numEnvs, sizeof(uint32_t)));
+        env->start  = static_cast<SystemState*>(malloc(sizeof(SystemState)));
+
+        if (!env->blocks || !env->frames || !env->start)
+        {
+            vecEnvShutdown(env);
+            return false;
+        }
+
+        for (uint32_t b = 0; b < env->numBlocks; ++b)
+        {
+            const uint32_t numLanes = numEnvs - b * LOCKSTEP_LANES;
+            lockstepInit(&env->blocks[b], numLanes);
+
+            if (!lockstepLoad(&env->blocks[b], rom, romSize))
+            {
+                vecEnvShutdown(env);
+                return false;
+            }
+        }
+
+        if (env->numBlocks)
+        {
+            lockstepSave(&env->blocks[0], 0, env->start);
+        }
+
+        return true;
+    }
+
+    void vecEnvShutdown(VecEnv* env)
+    {
+        free(env->blocks);
+        free(env->frames);
+        free(env->start);
+        memset(env, 0, sizeof(*env));
+    }
+
+    void vecEnvReset(VecEnv* env, const uint32_t* seeds)
+    {
+        const uint32_t obsSize = vecEnvObsSize(env->obsFormat);
+        uint8_t*       obs     = static_cast<uint8_t*>(env->obs);
+
+        for (uint32_t i = 0; i < env->numEnvs; ++i)
+        {
+            Lockstep*      ls   = &env->blocks[i / LOCKSTEP_LANES];
+            const uint32_t lane = i % LOCKSTEP_LANES;
+
+            startEpisode(env, ls, lane, seeds[i]);
+            env->frames[i] = 0;
+            writeObs(env, ls, lane, true, obs + i * obsSize);
+        }
+
+        env->lastObs       = env->obs;
+        env->lastObsFormat = env->obsFormat;
+    }
+
+    void vecEnvStep(VecEnv* env, const uint16_t* actions, float* o_rewards, bool* o_dones)
+    {
+        const uint32_t obsSize = vecEnvObsSize(env->obsFormat);
+        uint8_t*       obs     = static_cast<uint8_t*>(env->obs);
+        const bool     moved   = (env->obs != env->lastObs || env->obsFormat != env->lastObsFormat);
+
+        for (uint32_t b = 0; b < env->numBlocks; ++b)
+        {
+            Lockstep*      ls    = &env->blocks[b];
+            const uint32_t first = b * LOCKSTEP_LANES;
+
+            ls->cycleHz = env->cycleHz;
+            ls->quirks  = env->quirks;
+
+            for (uint32_t lane = 0; lane < ls->numLanes; ++lane)
+            {
+                ls->keys[lane]        = actions[first + lane];
+                o_dones[first + lane] = false;
+            }
+
+            // A lane that faults keeps faulting on the same instruction, so
+            // it's enough to catch it after any of the frames.
+            for (uint32_t frame = 0; frame < env->framesPerStep; ++frame)
+            {
+                uint64_t ends[LOCKSTEP_LANES];
+
+                for (uint32_t lane = 0; lane < ls->numLanes; ++lane)
+                {
+                    ends[lane] = nextFrame(ls, lane);
+                }
+
+                lockstepRunUntil(ls, ends);
+
+                for (uint32_t lane = 0; lane < ls->numLanes; ++lane)
+                {
+                    o_dones[first + lane] |= (ls->exit[lane] == RUN_UNKNOWN_OP || ls->exit[lane] == RUN_STACK_FAULT);
+                }
+            }
+
+            for (uint32_t lane = 0; lane < ls->numLanes; ++lane)
+            {
+                const uint32_t i = first + lane;
+
+                env->frames[i] += env->framesPerStep;
+                o_dones[i]     = o_dones[i] || (env->maxFrames && env->frames[i] >= env->maxFrames);
+                o_rewards[i]   = (env->reward ? env->reward(ls, lane, &o_dones[i], env->rewardData) : 0.0f);
+
+                if (o_dones[i])
+                {
+                    startEpisode(env, ls, lane, ls->rng[lane]);
+                    env->frames[i] = 0;
+                }
+
+                writeObs(env, ls, lane, moved || o_dones[i], obs + i * obsSize);
+            }
+        }
+
+        env->lastObs       = env->obs;
+        env->lastObsFormat = env->obsFormat;
+    }
+
+} // namespace c8e
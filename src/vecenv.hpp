@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2018 Johan Sköld
+// License: https://opensource.org/licenses/ISC
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include "lockstep.hpp"
+
+namespace c8e
+{
+
+    enum ObsFormat : uint8_t
+    {
+        OBS_PACKED, // The framebuffer as is: 32 rows of 64 bits, the leftmost pixel in the most significant bit.
+        OBS_BYTES,  // A byte per pixel, row by row, 1 where set and 0 where not.
+    };
+
+    // Rewards env `lane` of `ls` for the step it just took. `io_done` comes in
+    // set if the episode ends anyway, and may be set to end it early.
+    using RewardFn = float (*)(const Lockstep* ls, uint32_t lane, bool* io_done, void* userData);
+
+    // Instances of one ROM, or envs, stepped together a frame at a time with
+    // the keys an agent picks for each. The envs run in lockstep, in blocks
+    // of LOCKSTEP_LANES.
+    //
+    // An episode ends when its env faults, after `maxFrames`, or when the
+    // reward function says so. The env then starts a new episode at once,
+    // seeded with where the last one left its random number generator, and
+    // its observation is the first of the new episode.
+    struct VecEnv
+    {
+        Lockstep*    blocks;  // Env `i` is lane `i % LOCKSTEP_LANES` of block `i / LOCKSTEP_LANES`.
+        uint32_t*    frames;  // Frames into each env's current episode.
+        SystemState* start;   // Every episode starts from this, but for its seed.
+        uint32_t     numEnvs;
+        uint32_t     numBlocks;
+
+        // Where to write each env's observation, one after another. Sized by
+        // vecEnvObsSize. Steps only write the rows that changed, so the
+        // buffer has to hold the last observations when the next step runs.
+        // Pointing `obs` at another buffer, or changing `obsFormat`, makes
+        // the next step write every row.
+        void*     obs;
+        ObsFormat obsFormat;
+        void*     lastObs;       // Where, and in which format, observations were last written.
+        ObsFormat lastObsFormat;
+        uint32_t  framesPerStep; // Frames to run per step, with the same keys held. One by default.
+        uint32_t  maxFrames;     // Frames after which an episode ends, or zero for no limit.
+        uint32_t  cycleHz;       // As System::cycleHz. Frames run from one timer tick to the next.
+        uint8_t   quirks;        // Combination of Quirk flags, for all envs.
+        RewardFn  reward;        // Rewards nothing if nullptr.
+        void*     rewardData;
+    };
+
+    uint32_t vecEnvObsSize(ObsFormat format); // Per env.
+
+    bool vecEnvInit(VecEnv* env, uint32_t numEnvs, const void* rom, uint16_t romSize);
+    void vecEnvShutdown(VecEnv* env);
+
+    // Starts a new episode in every env, seeded with `seeds`, and writes
+    // their observations.
+    void vecEnvReset(VecEnv* env, const uint32_t* seeds);
+
+    // Runs every env with the System::Keys in `actions` held, and writes
+    // their observations. Allocates nothing, so it can run as often as the
+    // agent likes.
+    void vecEnvStep(VecEnv* env, const uint16_t* actions, float* o_rewards, bool* o_dones);
+
+} // namespace c8e